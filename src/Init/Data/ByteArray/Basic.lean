@@ -78,6 +78,55 @@ partial def toList (bs : ByteArray) : List UInt8 :=
 
 end ByteArray
 
+/--
+  A view of the bytes at `[start, stop)` in `data`. Slicing is O(1) as the bytes are not copied; use `toByteArray` to
+  obtain a copy. Note that the view keeps all of `data` alive. -/
+structure ByteSubarray where
+  data  : ByteArray
+  start : Nat
+  stop  : Nat
+
+/-- The view of the bytes at `[start, stop)` in `a`, where the bounds are clamped to the size of `a`. -/
+def ByteArray.toSubarray (a : ByteArray) (start : Nat := 0) (stop : Nat := a.size) : ByteSubarray :=
+  let stop := min stop a.size
+  { data := a, start := min start stop, stop := stop }
+
+instance : Coe ByteArray ByteSubarray := ⟨fun a => a.toSubarray⟩
+
+namespace ByteSubarray
+
+@[inline] def size (s : ByteSubarray) : Nat :=
+  s.stop - s.start
+
+@[inline] def isEmpty (s : ByteSubarray) : Bool :=
+  s.size == 0
+
+@[inline] def get! (s : ByteSubarray) (i : Nat) : UInt8 :=
+  if i < s.size then s.data.get! (s.start + i) else panic! "index out of bounds"
+
+/-- The view of the bytes at `[start, stop)` in `s`, where the bounds are relative to `s` and clamped to its size. -/
+@[inline] def slice (s : ByteSubarray) (start : Nat) (stop : Nat := s.size) : ByteSubarray :=
+  let stop := min stop s.size
+  { data := s.data, start := s.start + min start stop, stop := s.start + stop }
+
+def toByteArray (s : ByteSubarray) : ByteArray :=
+  s.data.extract s.start s.stop
+
+@[inline] partial def findIdx? (s : ByteSubarray) (p : UInt8 → Bool) (start := 0) : Option Nat :=
+  let rec @[specialize] loop (i : Nat) :=
+    if i < s.stop then
+      if p (s.data.get! i) then some (i - s.start) else loop (i+1)
+    else
+      none
+  loop (s.start + start)
+
+@[inline] partial def foldl {β : Type u} (f : β → UInt8 → β) (init : β) (s : ByteSubarray) : β :=
+  let rec @[specialize] loop (i : Nat) (b : β) :=
+    if i < s.stop then loop (i+1) (f b (s.data.get! i)) else b
+  loop s.start init
+
+end ByteSubarray
+
 def List.toByteArray (bs : List UInt8) : ByteArray :=
   let rec loop
     | [],    r => r
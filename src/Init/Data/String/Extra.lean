@@ -22,6 +22,12 @@ def toNat! (s : String) : Nat :=
 @[extern "lean_string_from_utf8_unchecked"]
 constant fromUTF8Unchecked (a : @& ByteArray) : String
 
+/--
+  Convert the UTF-8 encoded bytes of `s` to `String`, copying them only once.
+  The result is unspecified if `s` is not properly UTF-8 encoded. -/
+@[extern "lean_string_from_utf8_subarray_unchecked"]
+constant fromUTF8SubarrayUnchecked (s : @& ByteSubarray) : String
+
 @[extern "lean_string_to_utf8"]
 constant toUTF8 (a : @& String) : ByteArray
 
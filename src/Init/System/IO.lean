@@ -98,16 +98,23 @@ def sleep (ms : UInt32) : IO Unit :=
   except that the `Task` is started eagerly as usual. Thus pure accesses to the `Task` do not influence the impure `act`
   computation.
   Unlike with pure tasks created by `Task.mk`, tasks created by this function will be run even if the last reference
-  to the task is dropped. `act` should manually check for cancellation via `IO.checkCanceled` if it wants to react
-  to that. -/
+  to the task is dropped, unless the task has been canceled before being started (see `IO.cancel`). `act` should
+  manually check for cancellation via `IO.checkCanceled` if it wants to react to that. -/
 @[extern "lean_io_as_task"]
 constant asTask (act : IO α) (prio := Task.Priority.default) : IO (Task (Except IO.Error α))
 
-/-- See `IO.asTask`. -/
+/--
+  Run `f` on the result of `t` in a separate `Task` once `t` has finished, see `IO.asTask`. Like tasks created by
+  `IO.asTask`, the new task will be run even if the last reference to it is dropped. However, if `t` (or a task
+  `t` is waiting for) is canceled before the new task has been started and the new task is no longer referenced,
+  `f` is not run at all (see `IO.cancel`). Thus fire-and-forget continuations of canceled tasks do not run. -/
 @[extern "lean_io_map_task"]
 constant mapTask (f : α → IO β) (t : Task α) (prio := Task.Priority.default) : IO (Task (Except IO.Error β))
 
-/-- See `IO.asTask`. -/
+/--
+  Run `f` on the result of `t` once `t` has finished, and return a `Task` that finishes with the task returned by `f`,
+  see `IO.asTask`. As with `IO.mapTask`, `f` is not run at all if `t` (or a task `t` is waiting for) is canceled
+  before `f` has been started and the returned task is no longer referenced (see `IO.cancel`). -/
 @[extern "lean_io_bind_task"]
 constant bindTask (t : Task α) (f : α → IO (Task (Except IO.Error β))) (prio := Task.Priority.default) : IO (Task (Except IO.Error β))
 
@@ -122,7 +129,10 @@ where
 /-- Check if the task's cancellation flag has been set by calling `IO.cancel` or dropping the last reference to the task. -/
 @[extern "lean_io_check_canceled"] constant checkCanceled : IO Bool
 
-/-- Request cooperative cancellation of the task. The task must explicitly call `IO.checkCanceled` to react to the cancellation. -/
+/--
+  Request cooperative cancellation of the task and of all tasks waiting for it. A running task must explicitly call
+  `IO.checkCanceled` to react to the cancellation. Canceled tasks that have not been started yet and are no longer
+  referenced, not even by tasks waiting for them, are not run at all. -/
 @[extern "lean_io_cancel"] constant cancel : @& Task α → IO Unit
 
 /-- Check if the task has finished execution, at which point calling `Task.get` will return immediately. -/
@@ -137,6 +147,50 @@ where
 /-- Helper method for implementing "deterministic" timeouts. It is the numbe of "small" memory allocations performed by the current execution thread. -/
 @[extern "lean_io_get_num_heartbeats"] constant getNumHeartbeats : EIO ε Nat
 
+/-- Return the number of hardware threads, i.e., the number of tasks that can run in parallel without contention. -/
+@[extern "lean_io_get_num_cores"] constant getNumCores : IO Nat
+
+/--
+  Return the memory of the allocator that does not contain any live objects to the operating system.
+  This is useful after large computations such as elaborating a whole file, since the allocator otherwise
+  keeps the memory for future allocations. -/
+@[extern "lean_io_trim_heap"] constant trimHeap : IO Unit
+
+/--
+  Statistics of the allocator summed over all threads. Small objects are grouped in size classes, where the
+  `i`-th size class contains the objects of `8 * (i + 1)` bytes. Bigger objects are allocated using `malloc`. -/
+structure AllocStats where
+  numSmallAllocs      : Array Nat
+  numSmallDeallocs    : Array Nat
+  numBigAllocs        : Nat
+  numBigDeallocs      : Nat
+  bigAllocBytes       : Nat
+  bigDeallocBytes     : Nat
+  /-- Number of pages currently in use. -/
+  numPages            : Nat
+  /-- Number of segments currently in use. -/
+  numSegments         : Nat
+  numRecycledPages    : Nat
+  /-- Number of pages returned to the operating system, see `trimHeap`. -/
+  numDecommittedPages : Nat
+  numReleasedSegments : Nat
+  /-- Number of objects freed by a thread other than the one that allocated them. -/
+  numExportedObjs     : Nat
+  /-- Number of such objects that have been received by their allocating thread so far. -/
+  numImportedObjs     : Nat
+  deriving Inhabited
+
+/--
+  Return the current statistics of the allocator. They can also be written to `stderr` by sending the process the
+  signal whose number is stored in the environment variable `LEAN_ALLOC_STATS_SIGNAL`. -/
+@[extern "lean_io_get_alloc_stats"] constant getAllocStats : IO AllocStats
+
+/--
+  Free dead graphs of objects shared between threads partially on a background thread, such that the thread
+  releasing the last reference to such a graph frees at most `n` objects itself. This is disabled if `n` is `0`,
+  which is the default. -/
+@[extern "lean_io_set_background_free_threshold"] constant setBackgroundFreeThreshold (n : USize) : IO Unit
+
 inductive FS.Mode where
   | read | write | readWrite | append
 
@@ -152,6 +206,8 @@ structure FS.Stream where
   write   : ByteArray → IO Unit
   getLine : IO String
   putStr  : String → IO Unit
+  /-- Write the strings in order, as a single write if the stream supports it. -/
+  putStrs : Array String → IO Unit := fun ss => putStr (ss.foldl (· ++ ·) "")
 
 open FS
 
@@ -201,8 +257,20 @@ Once `h.isEof` is true, reading `h` will always return an empty array.
 @[extern "lean_io_prim_handle_read"] constant read  (h : @& Handle) (bytes : USize) : IO ByteArray
 @[extern "lean_io_prim_handle_write"] constant write (h : @& Handle) (buffer : @& ByteArray) : IO Unit
 
+/--
+Asynchronous variants of `read` and `write`. On Linux, pending operations on pipes are multiplexed on a shared event
+loop thread instead of blocking a thread each. `readAsync` finishes as soon as some data is available, returning an
+empty array at the end of the file. Data buffered by previous calls to `read` and `getLine` on `h` is returned first,
+and data buffered by previous writes is flushed first. Operations on other files, such as regular files, sockets and
+terminals, and on other platforms are executed synchronously.
+-/
+@[extern "lean_io_prim_handle_read_async"] constant readAsync (h : @& Handle) (bytes : USize) : IO (Task (Except IO.Error ByteArray))
+@[extern "lean_io_prim_handle_write_async"] constant writeAsync (h : @& Handle) (buffer : @& ByteArray) : IO (Task (Except IO.Error Unit))
+
 @[extern "lean_io_prim_handle_get_line"] constant getLine (h : @& Handle) : IO String
 @[extern "lean_io_prim_handle_put_str"] constant putStr (h : @& Handle) (s : @& String) : IO Unit
+/-- Write the strings in order using a single vectored write (`writev`) where available. -/
+@[extern "lean_io_prim_handle_put_strs"] constant putStrs (h : @& Handle) (ss : @& Array String) : IO Unit
 
 end Handle
 
@@ -234,6 +302,15 @@ partial def Handle.readBinToEnd (h : Handle) : IO ByteArray := do
       loop (acc ++ buf)
   loop ByteArray.empty
 
+/-- Like `readBinToEnd`, but does not block a thread while waiting for data, see `Handle.readAsync`. -/
+partial def Handle.readBinToEndAsync (h : Handle) : IO (Task (Except IO.Error ByteArray)) := do
+  let rec loop (acc : ByteArray) : IO (Task (Except IO.Error ByteArray)) := do
+    let t ← h.readAsync 65536
+    IO.bindTask t fun
+      | Except.ok buf   => if buf.isEmpty then pure (Task.pure (Except.ok acc)) else loop (acc ++ buf)
+      | Except.error e  => pure (Task.pure (Except.error e))
+  loop ByteArray.empty
+
 partial def Handle.readToEnd (h : Handle) : IO String := do
   let rec loop (s : String) := do
     let line ← h.getLine
@@ -243,13 +320,11 @@ partial def Handle.readToEnd (h : Handle) : IO String := do
       loop (s ++ line)
   loop ""
 
-def readBinFile (fname : FilePath) : IO ByteArray := do
-  let h ← Handle.mk fname Mode.read true
-  h.readBinToEnd
+/-- Read the whole file into a `ByteArray` of the exact size, without intermediate copies. -/
+@[extern "lean_io_read_bin_file"] constant readBinFile (fname : @& FilePath) : IO ByteArray
 
-def readFile (fname : FilePath) : IO String := do
-  let h ← Handle.mk fname Mode.read false
-  h.readToEnd
+/-- Read the whole file into a `String` of the exact size, without intermediate copies. -/
+@[extern "lean_io_read_file"] constant readFile (fname : @& FilePath) : IO String
 
 partial def lines (fname : FilePath) : IO (Array String) := do
   let h ← Handle.mk fname Mode.read false
@@ -441,11 +516,11 @@ structure Output where
 /-- Run process to completion and capture output. -/
 def output (args : SpawnArgs) : IO Output := do
   let child ← spawn { args with stdout := Stdio.piped, stderr := Stdio.piped }
-  let stdout ← IO.asTask child.stdout.readToEnd Task.Priority.dedicated
+  let stdout ← child.stdout.readBinToEndAsync
   let stderr ← child.stderr.readToEnd
   let exitCode ← child.wait
   let stdout ← IO.ofExcept stdout.get
-  pure { exitCode := exitCode, stdout := stdout, stderr := stderr }
+  pure { exitCode := exitCode, stdout := String.fromUTF8Unchecked stdout, stderr := stderr }
 
 /-- Run process to completion and return stdout on success. -/
 def run (args : SpawnArgs) : IO String := do
@@ -507,6 +582,7 @@ def ofHandle (h : Handle) : Stream := {
   write   := Handle.write h,
   getLine := Handle.getLine h,
   putStr  := Handle.putStr h,
+  putStrs := Handle.putStrs h,
 }
 
 structure Buffer where
@@ -527,7 +603,7 @@ def ofBuffer (r : Ref Buffer) : Stream := {
       -- include '\n', but not '\0'
       | some pos => if b.data.get! pos == 0 then pos else pos + 1
       | none     => b.data.size
-    (String.fromUTF8Unchecked <| b.data.extract b.pos pos, { b with pos := pos }),
+    (String.fromUTF8SubarrayUnchecked <| b.data.toSubarray b.pos pos, { b with pos := pos }),
   putStr  := fun s => r.modify fun b =>
     let data := s.toUTF8
     { b with data := data.copySlice 0 b.data b.pos data.size false, pos := b.pos + data.size },
@@ -81,10 +81,10 @@ section
 
   def writeLspMessage (h : FS.Stream) (msg : Message) : IO Unit := do
     -- inlined implementation instead of using jsonrpc's writeMessage
-    -- to maintain the atomicity of putStr
+    -- to maintain the atomicity of the write; `putStrs` avoids concatenating header and body
     let j := (toJson msg).compress
     let header := s!"Content-Length: {toString j.utf8ByteSize}\r\n\r\n"
-    h.putStr (header ++ j)
+    h.putStrs #[header, j]
     h.flush
 
   def writeLspRequest (h : FS.Stream) (r : Request α) : IO Unit :=
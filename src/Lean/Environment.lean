@@ -465,10 +465,23 @@ structure ModuleData where
 instance : Inhabited ModuleData :=
   ⟨{imports := arbitrary, constants := arbitrary, entries := arbitrary }⟩
 
-@[extern 3 "lean_save_module_data"]
-constant saveModuleData (fname : @& System.FilePath) (m : ModuleData) : IO Unit
+/--
+  Save `m` to the .olean file `fname`. The module name `mod` is used to derive the address at which the file is
+  memory-mapped by `readModuleData`, see `module.cpp`. Objects of `m` that belong to one of the compacted regions
+  `imports` of imported modules are referenced instead of being copied into the file. -/
+@[extern 5 "lean_save_module_data"]
+constant saveModuleData (fname : @& System.FilePath) (mod : @& Name) (imports : @& Array CompactedRegion) (m : ModuleData) : IO Unit
+/--
+  Read the .olean file `fname`. If the file references objects of imported modules, only the `imports` field of the
+  result may be accessed until `linkModuleRegions` has been invoked on the regions of all imported modules. -/
 @[extern 2 "lean_read_module_data"]
 constant readModuleData (fname : @& System.FilePath) : IO (ModuleData × CompactedRegion)
+/--
+  Resolve the references between the compacted regions `regions` returned by `readModuleData`. Must be invoked exactly
+  once on these regions. Throws an error if a referenced module is missing or has changed since the referencing module
+  was saved. -/
+@[extern "lean_link_module_regions"]
+constant linkModuleRegions (regions : @& Array CompactedRegion) : IO Unit
 
 /--
   Free compacted regions of imports. No live references to imported objects may exist at the time of invocation; in
@@ -507,9 +520,18 @@ def mkModuleData (env : Environment) : IO ModuleData := do
     entries    := entries
   }
 
+/--
+  Write the .olean file of `env`. If the environment variable `LEAN_OLEAN_SHARE_IMPORTS` is set, objects of imported
+  modules, such as the names of imported declarations, are referenced instead of being copied into the file.
+  The file can then only be imported together with the exact same versions of these modules. -/
 @[export lean_write_module]
 def writeModule (env : Environment) (fname : System.FilePath) : IO Unit := do
-  let modData ← mkModuleData env; saveModuleData fname modData
+  let modData ← mkModuleData env
+  let mut imports := #[]
+  if (← IO.getEnv "LEAN_OLEAN_SHARE_IMPORTS").isSome then
+    -- `regions` may also contain the region of the import index
+    imports := env.header.regions.extract 0 env.header.moduleNames.size
+  saveModuleData fname env.mainModule imports modData
 
 private partial def getEntriesFor (mod : ModuleData) (extId : Name) (i : Nat) : Array EnvExtensionEntry :=
   if i < mod.entries.size then
@@ -542,30 +564,128 @@ structure ImportState where
   moduleData    : Array ModuleData := #[]
   regions       : Array CompactedRegion := #[]
 
-@[export lean_import_modules]
-partial def importModules (imports : List Import) (opts : Options) (trustLevel : UInt32 := 0) : IO Environment := profileitIO "import" opts do
-  let (_, s) ← importMods imports |>.run {}
-  -- (moduleNames, mods, regions)
+/--
+  Read the .olean files of `imports` and, transitively, of their imports. The import graph is explored level by level,
+  and the modules newly discovered on a level are read in parallel by at most `IO.getNumCores` tasks. The tasks run on
+  dedicated threads since we block on them, which could otherwise exhaust the task pool when `importModules` is itself
+  run in a task. Errors are recorded for the respective module instead of being thrown, so that `importModules` can
+  report them in the order of a sequential traversal. The imports of modules that could not be read are not explored. -/
+private partial def readModules (imports : List Import) : IO (HashMap Name (Except IO.Error (ModuleData × CompactedRegion))) := do
+  go imports {} (max 1 (← IO.getNumCores))
+where
+  readModule (mod : Name) : IO (ModuleData × CompactedRegion) := do
+    let mFile ← findOLean mod
+    unless (← mFile.pathExists) do
+      throw $ IO.userError s!"object file '{mFile}' of module {mod} does not exist"
+    readModuleData mFile
+  go (imports : List Import) (loaded : HashMap Name (Except IO.Error (ModuleData × CompactedRegion))) (maxReaders : Nat) :
+      IO (HashMap Name (Except IO.Error (ModuleData × CompactedRegion))) := do
+    let mut pending : Array Name := #[]
+    let mut pendingSet : NameSet := {}
+    for i in imports do
+      unless i.runtimeOnly || loaded.contains i.module || pendingSet.contains i.module do
+        pendingSet := pendingSet.insert i.module
+        pending := pending.push i.module
+    if pending.isEmpty then
+      return loaded
+    let numReaders := min maxReaders pending.size
+    let mut batches : Array (Array Name) := mkArray numReaders #[]
+    let mut idx := 0
+    for mod in pending do
+      batches := batches.modify (idx % numReaders) fun batch => batch.push mod
+      idx := idx + 1
+    let mut readers := #[]
+    for batch in batches do
+      let reader ← IO.asTask (prio := Task.Priority.dedicated) <| batch.mapM fun mod => do
+        return (mod, ← EIO.toIO' (readModule mod))
+      readers := readers.push reader
+    let mut loaded := loaded
+    let mut next : Array Import := #[]
+    for reader in readers do
+      match (← IO.wait reader) with
+      | Except.ok results =>
+        for (mod, result) in results do
+          loaded := loaded.insert mod result
+          if let Except.ok (data, _) := result then
+            next := next ++ data.imports
+      | Except.error e => throw e
+    go next.toList loaded maxReaders
+
+private def mkConst2ModIdx (mods : Array ModuleData) (numConsts : Nat) : HashMap Name ModuleIdx := Id.run do
   let mut modIdx : Nat := 0
-  let mut const2ModIdx : HashMap Name ModuleIdx := {}
-  let mut constants : ConstMap := SMap.empty
-  for mod in s.moduleData do
+  let mut const2ModIdx : HashMap Name ModuleIdx := Std.mkHashMap (nbuckets := numConsts)
+  for mod in mods do
     for cinfo in mod.constants do
       const2ModIdx := const2ModIdx.insert cinfo.name modIdx
+    modIdx := modIdx + 1
+  return const2ModIdx
+
+/- Tables of the constants of an import closure, see `importModules`. -/
+structure ImportIndex where
+  const2ModIdx : HashMap Name ModuleIdx
+  constants    : HashMap Name ConstantInfo
+
+/-- Mix the version of Lean and of the format of import indices into `key`. -/
+@[extern "lean_import_index_key"]
+constant importIndexKey (key : UInt64) : UInt64
+/--
+  Save `index` to the import index file `fname`. The index references the objects of the compacted `regions` of the
+  import closure instead of copying them, and is only valid as long as these regions are mapped at their base address.
+  Return `false` if this is not the case, or if import indices are not supported on this platform. -/
+@[extern "lean_save_import_index"]
+constant saveImportIndex (fname : @& System.FilePath) (key : UInt64) (regions : @& Array CompactedRegion) (index : ImportIndex) : IO Bool
+/--
+  Memory-map the import index `fname` saved using `saveImportIndex`. Return `none` if it does not exist or does not match
+  `key` and the current contents of `regions`. -/
+@[extern "lean_read_import_index"]
+constant readImportIndex (fname : @& System.FilePath) (key : UInt64) (regions : @& Array CompactedRegion) : IO (Option (ImportIndex × CompactedRegion))
+
+private def mkImportIndex (mods : Array ModuleData) : IO ImportIndex := do
+  let numConsts := mods.foldl (fun n mod => n + mod.constants.size) 0
+  -- build `const2ModIdx` in parallel with `constants`; both tables are allocated with their final size up front
+  let const2ModIdx := Task.spawn fun _ => mkConst2ModIdx mods numConsts
+  let mut constants : HashMap Name ConstantInfo := Std.mkHashMap (nbuckets := numConsts)
+  for mod in mods do
+    for cinfo in mod.constants do
       if constants.contains cinfo.name then throw (IO.userError s!"import failed, environment already contains '{cinfo.name}'")
       constants := constants.insert cinfo.name cinfo
-    modIdx := modIdx + 1
-  constants   := constants.switch
+  return { const2ModIdx := const2ModIdx.get, constants := constants }
+
+/--
+  Return the import index of the import closure `s` and the compacted regions of the closure. If the environment
+  variable `LEAN_IMPORT_INDEX_DIR` is set, indices are cached in this directory, so that later imports of the same
+  closure can memory-map the index instead of rebuilding it. -/
+private def getImportIndex (s : ImportState) : IO (ImportIndex × Array CompactedRegion) := do
+  let some dir ← IO.getEnv "LEAN_IMPORT_INDEX_DIR"
+    | return (← mkImportIndex s.moduleData, s.regions)
+  let key := importIndexKey <| s.moduleNames.foldl (fun h n => mixHash h (hash n)) 7
+  let fname := System.FilePath.mk dir / s!"{key}.lidx"
+  match (← readImportIndex fname key s.regions) with
+  | some (index, region) => return (index, s.regions.push region)
+  | none =>
+    let index ← mkImportIndex s.moduleData
+    -- the cache is merely an optimization
+    try discard <| saveImportIndex fname key s.regions index catch _ => pure ()
+    return (index, s.regions)
+
+@[export lean_import_modules]
+partial def importModules (imports : List Import) (opts : Options) (trustLevel : UInt32 := 0) : IO Environment := profileitIO "import" opts do
+  let loaded ← readModules imports
+  -- order modules as in a sequential depth-first traversal of the imports, so that module indices are deterministic
+  let (_, s) ← importMods loaded imports |>.run {}
+  linkModuleRegions s.regions
+  let (index, regions) ← getImportIndex s
+  let constants : ConstMap := { map₁ := index.constants }
   let exts ← mkInitialExtensionStates
   let env : Environment := {
-    const2ModIdx := const2ModIdx,
-    constants    := constants,
+    const2ModIdx := index.const2ModIdx,
+    constants    := constants.switch,
     extensions   := exts,
     header       := {
       quotInit     := !imports.isEmpty, -- We assume `core.lean` initializes quotient module
       trustLevel   := trustLevel,
       imports      := imports.toArray,
-      regions      := s.regions,
+      regions      := regions,
       moduleNames  := s.moduleNames
     }
   }
@@ -573,24 +693,24 @@ partial def importModules (imports : List Import) (opts : Options) (trustLevel :
   let env ← finalizePersistentExtensions env opts
   pure env
 where
-  importMods : List Import → StateRefT ImportState IO Unit
+  importMods (loaded : HashMap Name (Except IO.Error (ModuleData × CompactedRegion))) : List Import → StateRefT ImportState IO Unit
   | []    => pure ()
   | i::is => do
     if i.runtimeOnly || (← get).moduleNameSet.contains i.module then
-      importMods is
+      importMods loaded is
     else do
       modify fun s => { s with moduleNameSet := s.moduleNameSet.insert i.module }
-      let mFile ← findOLean i.module
-      unless (← mFile.pathExists) do
-        throw $ IO.userError s!"object file '{mFile}' of module {i.module} does not exist"
-      let (mod, region) ← readModuleData mFile
-      importMods mod.imports.toList
+      -- `readModules` explored all imports of the modules visited so far, as they have been read successfully
+      let (mod, region) ← match loaded.find! i.module with
+        | Except.ok r    => pure r
+        | Except.error e => throw e
+      importMods loaded mod.imports.toList
       modify fun s => { s with
         moduleData  := s.moduleData.push mod
         regions     := s.regions.push region
         moduleNames := s.moduleNames.push i.module
       }
-      importMods is
+      importMods loaded is
 /--
   Create environment object from imports and free compacted regions after calling `act`. No live references to the
   environment object or imported objects may exist after `act` finishes. -/
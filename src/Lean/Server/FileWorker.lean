@@ -75,6 +75,8 @@ section Elab
     | Sum.inr msgLog =>
       publishMessages m msgLog hOut
       publishProgressDone m hOut
+      -- the temporary objects of elaborating the whole document are gone, so shrink the worker to its live data
+      IO.trimHeap
       throw ElabTaskError.eof
 
   /-- Elaborates all commands after `initSnap`, emitting the diagnostics into `hOut`. -/
@@ -351,6 +353,8 @@ def initAndRunWorker (i o e : FS.Stream) : IO UInt32 := do
 
 @[export lean_server_worker_main]
 def workerMain : IO UInt32 := do
+  -- do not block request handling on freeing old snapshots and environments
+  IO.setBackgroundFreeThreshold 10000
   let i ← IO.getStdin
   let o ← IO.getStdout
   let e ← IO.getStderr
@@ -46,7 +46,11 @@ def chainLeft (a : Stream) (b : Stream) (flushEagerly : Bool := false) : Stream
     putStr := fun s => do
       a.putStr s
       if flushEagerly then a.flush
-      b.putStr s }
+      b.putStr s
+    putStrs := fun ss => do
+      a.putStrs ss
+      if flushEagerly then a.flush
+      b.putStrs ss }
 
 /-- Prefixes all written outputs with `pre`. -/
 def withPrefix (a : Stream) (pre : String) : Stream :=
@@ -55,7 +59,9 @@ def withPrefix (a : Stream) (pre : String) : Stream :=
       a.putStr pre
       a.write bs
     putStr := fun s =>
-      a.putStr (pre ++ s) }
+      a.putStr (pre ++ s)
+    putStrs := fun ss =>
+      a.putStrs (#[pre] ++ ss) }
 
 end FS.Stream
 end IO
@@ -7,12 +7,47 @@ Author: Leonardo de Moura
 #pragma once
 #include <stddef.h>
 #include <stdint.h>
+#include <iosfwd>
+#include <vector>
 
 namespace lean {
+/* Statistics of the allocator summed over all threads. Small objects are grouped in size classes, where the
+   `i`-th size class contains the objects of size `(i+1)*LEAN_OBJECT_SIZE_DELTA`. Objects bigger than
+   `LEAN_MAX_SMALL_OBJECT_SIZE` are allocated using `malloc`. */
+struct alloc_stats {
+    std::vector<uint64_t> m_num_small_alloc;
+    std::vector<uint64_t> m_num_small_dealloc;
+    uint64_t m_num_big_alloc{0};
+    uint64_t m_num_big_dealloc{0};
+    uint64_t m_big_alloc_bytes{0};
+    uint64_t m_big_dealloc_bytes{0};
+    /* Number of pages and segments currently in use. */
+    uint64_t m_num_pages{0};
+    uint64_t m_num_segments{0};
+    uint64_t m_num_recycled_pages{0};
+    uint64_t m_num_decommitted_pages{0};
+    uint64_t m_num_released_segments{0};
+    /* Number of objects freed by a thread other than the one owning their page, and number of such objects
+       received by the owners so far. */
+    uint64_t m_num_exported_objs{0};
+    uint64_t m_num_imported_objs{0};
+};
 void init_thread_heap();
 void * alloc(size_t sz);
 void dealloc(void * o, size_t sz);
 uint64_t get_num_heartbeats();
+/* Return memory of the current thread's heap and of the heaps of finished threads that does not contain live
+   objects to the operating system. */
+void trim_heap();
+/* Advise the operating system to back the given memory with huge pages if they have been enabled using the
+   environment variable `LEAN_HUGE_PAGES`, see `initialize_alloc`. */
+void advise_huge_pages(void * mem, size_t sz);
+alloc_stats get_alloc_stats();
+void display_alloc_stats(std::ostream & out);
+/* Display the allocator statistics on `stderr` if they have been requested using the signal set by
+   `LEAN_ALLOC_STATS_SIGNAL` since the last call. As this allocates and takes locks, it must only be called at safe
+   points such as `check_system` and between tasks, not from the allocator itself. */
+void display_requested_alloc_stats();
 void initialize_alloc();
 void finalize_alloc();
 }
@@ -7,28 +7,77 @@ Author: Leonardo de Moura
 #pragma once
 #include <functional>
 #include <vector>
+#include <map>
 #include <unordered_map>
 #include <lean/object.h>
 
 namespace lean {
 typedef lean_object * object_offset;
 
+/* Layout versions of compacted regions. Pointers stored in a region are always relative to some base address, so
+   that the region can be loaded at any address by adding the difference between the load address and the base
+   address to each pointer (see `compacted_region::read`). */
+enum class compacted_region_format : uint8 {
+    /* Pointers are offsets from the beginning of the region (i.e., the base address is `nullptr`), and `mpz` values are
+       stored as decimal strings that are converted into GMP values when the region is read. */
+    v0 = 0,
+    /* Pointers are relative to the base address passed to `object_compactor`, and `mpz` limbs are stored in place. */
+    v1 = 1,
+    /* Format produced by `object_compactor`. */
+    current = v1
+};
+
 class object_compactor {
     struct max_sharing_table;
+    /* See `add_external_region` and `add_import_region`. */
+    struct external_region {
+        void const *        m_begin;
+        void const *        m_end;
+        /* Address the region is assumed to be located at in the compacted data. */
+        void const *        m_base_addr;
+        /* If true, the positions of references to the region are recorded in `m_refs`. */
+        bool                m_is_import;
+        std::vector<size_t> m_refs;
+    };
     friend struct max_sharing_hash;
     friend struct max_sharing_eq;
     std::unordered_map<object*, object_offset, std::hash<object*>, std::equal_to<object*>> m_obj_table;
     std::unique_ptr<max_sharing_table> m_max_sharing_table;
     std::vector<object*> m_todo;
     std::vector<object_offset> m_tmp;
+    /* Maps the beginning of each external region to its description. */
+    std::map<void const *, external_region> m_external_regions;
+    bool m_has_import_regions;
+    /* If true, objects of external regions are copied, see `copy_local`. */
+    bool m_local;
+    void * m_base_addr;
+    /* Buffer containing the compacted data after the first `m_flushed` bytes. */
     void * m_begin;
     void * m_end;
     void * m_capacity;
+    /* File the compacted data is written to in streaming mode, or -1. */
+    int    m_fd;
+    /* Position of the compacted data in `m_fd`. */
+    size_t m_fd_offset;
+    /* Number of bytes of compacted data already written to `m_fd`. */
+    size_t m_flushed;
+    /* Read-only mapping of the first `m_map_size` bytes of `m_fd`. */
+    char * m_map;
+    size_t m_map_size;
     size_t capacity() const { return static_cast<char*>(m_capacity) - static_cast<char*>(m_begin); }
+    size_t buffer_size() const { return static_cast<char*>(m_end) - static_cast<char*>(m_begin); }
+    /* Offset in the compacted data of `p`, which must point into the buffer. */
+    size_t offset_of(void const * p) const { return m_flushed + (static_cast<char const*>(p) - static_cast<char*>(m_begin)); }
+    char const * at(size_t offset) const;
+    void flush();
+    void save(object * o, size_t new_o_offset);
     void save(object * o, object * new_o);
-    void save_max_sharing(object * o, object * new_o, size_t new_o_sz);
+    bool save_max_sharing(object * o, object * new_o, size_t new_o_sz);
     void * alloc(size_t sz);
+    external_region const * find_external(object * o) const;
     object_offset to_offset(object * o);
+    void record_import_ref(object * o, void const * slot);
+    void copy(object * o);
     void insert_terminator(object * o);
     object * copy_object(object * o);
     bool insert_constructor(object * o);
@@ -40,22 +89,59 @@ class object_compactor {
     bool insert_ref(object * o);
     void insert_mpz(object * o);
 public:
-    object_compactor();
+    /* Pointers in the compacted data are computed as if it was stored at `base_addr`.
+       If the data is later loaded at this address, `compacted_region::read` does not need
+       to relocate any object. */
+    explicit object_compactor(void * base_addr = nullptr);
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+    /* Streaming mode: the compacted data is written to the file `fd` starting at position `fd_offset` in chunks of
+       bounded size, instead of being accumulated in memory. Objects that were already written are read back through
+       a read-only mapping of the file when looking for duplicates, so that they are only held by the page cache.
+       `fd` must be open for reading and writing, and it is not closed by the compactor. The data is complete after
+       each `operator()` invocation. Throws an exception if writing the file fails. */
+    object_compactor(void * base_addr, int fd, size_t fd_offset);
+#endif
     object_compactor(object_compactor const &) = delete;
     object_compactor(object_compactor &&) = delete;
     ~object_compactor();
     object_compactor operator=(object_compactor const &) = delete;
     object_compactor operator=(object_compactor &&) = delete;
+    /* Objects stored in `[begin, end)` are not copied, and references to them are stored as absolute pointers.
+       The resulting compacted region is only valid while the objects remain at their current address, and
+       it must not be relocated when reading it. */
+    void add_external_region(void const * begin, void const * end);
+    /* Objects stored in `[begin, end)` are not copied, and references to them are stored as if the region was located
+       at `base_addr`. The positions of these references are recorded (see `get_import_refs`), so that they can be
+       relocated when the region is not located at `base_addr` while reading the compacted data. The ranges
+       `[base_addr, base_addr + (end - begin))` of import regions must not overlap. */
+    void add_import_region(void const * begin, void const * end, void const * base_addr);
+    /* Offsets in the compacted data of the references to objects of the import region starting at `begin`. */
+    std::vector<size_t> const & get_import_refs(void const * begin) const;
+    /* Copy the objects reachable from `o` without referencing objects of external regions, and without adding a
+       root. Objects copied this way are shared with later roots. */
+    void copy_local(object * o);
     void operator()(object * o);
-    size_t size() const { return static_cast<char*>(m_end) - static_cast<char*>(m_begin); }
-    void const * data() const { return m_begin; }
+    size_t size() const { return m_flushed + buffer_size(); }
+    void const * data() const { return m_fd == -1 ? m_begin : m_map ? m_map + m_fd_offset : nullptr; }
+    void * base_addr() const { return m_base_addr; }
 };
 
 class compacted_region {
+    /* Address the region was compacted against, see `object_compactor`. */
+    void *            m_base_addr;
     void *            m_begin;
     void *            m_next;
     void *            m_end;
+    compacted_region_format m_format;
+    /* If true, the region may contain references to objects of import regions, see
+       `object_compactor::add_import_region`. They are not relocated by `read`. */
+    bool              m_has_imports;
+    /* If true, objects are relocated by the owner of the region when they are first accessed, see `relocate_block`. */
+    bool              m_relocated_on_access;
+    /* `mpz` values allocated using GMP when reading a `v0` region. */
     mpz_object *      m_nested_mpzs;
+    /* Releases the memory of the region. */
+    std::function<void()> m_free_data;
     void move(size_t d);
     void move(object * o);
     object * fix_object_ptr(object * o);
@@ -65,18 +151,42 @@ class compacted_region {
     void fix_ref(object * o);
     void fix_task(object * o);
     void fix_mpz(object * o);
+    void fix_mpz_v0(object * o);
 public:
     /* Creates a compacted object region using the given region in memory.
-       This object takes ownership of the region. */
+       This object takes ownership of the region, which must have been allocated using `malloc`. */
     compacted_region(size_t sz, void * data);
+    /* Creates a compacted object region using the given region in memory, which has been compacted
+       using `base_addr`. If `data == base_addr`, no relocation is performed, and the region may be
+       read-only memory (e.g., a memory-mapped file). Otherwise, objects are relocated in place, touching
+       only memory that contains pointers. `free_data` is invoked when the region is destroyed. */
+    compacted_region(size_t sz, void * data, void * base_addr, std::function<void()> const & free_data,
+                     compacted_region_format format = compacted_region_format::current);
     /* Creates a compacted object region using the object_compactor current state.
        It creates a copy of the compacted region generated by the object compactor. */
     explicit compacted_region(object_compactor const & c);
     compacted_region(compacted_region const &) = delete;
     compacted_region(compacted_region &&) = delete;
-    ~compacted_region();
+    virtual ~compacted_region();
     compacted_region operator=(compacted_region const &) = delete;
     compacted_region operator=(compacted_region &&) = delete;
+    /* Must be invoked before `read` if the region was compacted using `object_compactor::add_import_region`. */
+    void set_has_imports() { m_has_imports = true; }
+    /* Must be invoked before `read` if the owner of the region relocates each part of it using `relocate_block` before
+       it is first accessed. `read` then returns the root without touching any other object. */
+    void set_relocated_on_access() { m_relocated_on_access = true; }
+    /* Size of the object `o` of a compacted region, which need not be relocated yet. */
+    static size_t object_byte_size(object * o);
+    /* Copy the bytes `[begin, end)` of the data `src` of the region before relocation to the same offsets of `dst`,
+       relocating the pointers stored in them. `first_obj` must be the offset of the object containing the byte at
+       `begin`. Only the objects overlapping `[begin, end)` are read. `dst` may be `src` for relocating in place, in which
+       case only the headers of objects overlapping `[begin, end)` are read outside of it. */
+    void relocate_block(char const * src, char * dst, size_t first_obj, size_t begin, size_t end);
     object * read();
+    void const * data() const { return m_begin; }
+    size_t size() const { return static_cast<char*>(m_end) - static_cast<char*>(m_begin); }
+    void * base_addr() const { return m_base_addr; }
+    /* Return true if the region is located at the address it was compacted against. */
+    bool is_at_base_addr() const { return m_begin == m_base_addr; }
 };
 }
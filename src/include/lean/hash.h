@@ -14,6 +14,9 @@ void mix(unsigned & a, unsigned & b, unsigned & c);
 
 unsigned hash_str(size_t len, char const * str, unsigned init_value);
 
+/* Fast 64-bit hash of large byte sequences, e.g. for checksums. */
+uint64 hash_bytes64(size_t len, char const * str, uint64 seed);
+
 inline unsigned hash(unsigned h1, unsigned h2) {
     h2 -= h1; h2 ^= (h1 << 8);
     h1 -= h2; h2 ^= (h1 << 16);
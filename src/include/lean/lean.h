@@ -213,6 +213,8 @@ typedef struct {
     lean_object *        m_closure;
     struct lean_task *   m_head_dep;
     struct lean_task *   m_next_dep;
+    /* Threads blocked on the completion of this task, see `lean_task_get` and `lean_io_wait_any` */
+    struct lean_task_waiter * m_head_waiter;
     unsigned             m_prio;
     uint8_t              m_canceled;
     // If true, task will not be freed until finished
@@ -229,6 +231,7 @@ typedef struct {
    * Task.spawn ==> Queued
    * Task.map/bind ==> Waiting
    * Task.pure ==> Finished
+   * mk_promise ==> Running
 
    states:
    * Queued
@@ -249,6 +252,7 @@ typedef struct {
      * invariant: m_value == nullptr
      * transition: RC becomes 0 ==> Deactivated (`deactivate_task` lock)
      * transition: finished execution                   ==> Finished    (`spawn_worker` lock)
+     * transition: promise resolved                     ==> Finished    (`resolve_promise` lock)
    * Deactivated
      * condition: m_imp != nullptr && m_imp->m_deleted
      * invariant: RC == 0
@@ -257,6 +261,7 @@ typedef struct {
      * invariant: m_value == nullptr
      * transition: dequeued by worker thread   ==> freed
      * transition: finished execution          ==> freed
+     * transition: promise resolved            ==> freed
      * transition: task dependency Finished    ==> freed
      * We must keep the task object alive until one of these transitions because in either case, we have live
        (internal, unowned) references to the task up to that point
@@ -293,6 +298,9 @@ static inline lean_object * lean_box(size_t n) { return (lean_object*)(((size_t)
 static inline size_t lean_unbox(lean_object * o) { return (size_t)(o) >> 1; }
 
 void lean_set_exit_on_panic(bool flag);
+/* Free dead graphs of multi-threaded objects with more than `n` objects partially on a background thread.
+   The background thread is not used if `n` is `0`, which is the default. */
+void lean_set_background_free_threshold(size_t n);
 lean_object * lean_panic_fn(lean_object * default_val, lean_object * msg);
 
 __attribute__((noreturn)) void lean_internal_panic(char const * msg);
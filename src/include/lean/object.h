@@ -255,6 +255,7 @@ inline uint32 char_default_value() { return lean_char_default_value(); }
 inline obj_res alloc_string(size_t size, size_t capacity, size_t len) { return lean_alloc_string(size, capacity, len); }
 inline obj_res mk_string(char const * s) { return lean_mk_string(s); }
 obj_res mk_string(std::string const & s);
+obj_res mk_string_from_bytes(char const * s, size_t sz);
 std::string string_to_std(b_obj_arg o);
 inline char const * string_cstr(b_obj_arg o) { return lean_string_cstr(o); }
 inline size_t string_size(b_obj_arg o) { return lean_string_size(o); }
@@ -302,6 +303,12 @@ inline obj_res task_bind(obj_arg x, obj_arg f, unsigned prio = 0, bool keep_aliv
 inline obj_res task_map(obj_arg f, obj_arg t, unsigned prio = 0, bool keep_alive = false) { return lean_task_map_core(f, t, prio, keep_alive); }
 inline b_obj_res task_get(b_obj_arg t) { return lean_task_get(t); }
 
+/* Create a task that is not executed by the task manager but finished by `resolve_promise`, e.g. from an IO event
+   loop. Return `nullptr` if there is no task manager. */
+obj_res mk_promise();
+/* Finish the task created by `mk_promise` with value `v`. */
+void resolve_promise(b_obj_arg promise, obj_arg v);
+
 inline bool io_check_canceled_core() { return lean_io_check_canceled_core(); }
 inline void io_cancel_core(b_obj_arg t) { return lean_io_cancel_core(t); }
 inline bool io_has_finished_core(b_obj_arg t) { return lean_io_has_finished_core(t); }
@@ -88,8 +88,8 @@ public:
     atomic & operator=(atomic const & v) { m_value = v.m_value; return *this; }
     atomic & operator=(atomic && v) { m_value = std::forward<T>(v.m_value); return *this; }
     operator T() const { return m_value; }
-    void store(T const & v) { m_value = v; }
-    T load() const { return m_value; }
+    void store(T const & v, int = memory_order_seq_cst) { m_value = v; }
+    T load(int = memory_order_seq_cst) const { return m_value; }
     atomic & operator|=(T const & v) { m_value |= v; return *this; }
     atomic & operator+=(T const & v) { m_value += v; return *this; }
     atomic & operator-=(T const & v) { m_value -= v; return *this; }
@@ -101,8 +101,8 @@ public:
     friend T atomic_load_explicit(atomic const * a, int) { return a->m_value; }
     friend T atomic_fetch_add_explicit(atomic * a, T const & v, int ) { T r(a->m_value); a->m_value += v; return r; }
     friend T atomic_fetch_sub_explicit(atomic * a, T const & v, int ) { T r(a->m_value); a->m_value -= v; return r; }
-    T exchange(T desired) { T old = m_value; m_value = desired; return old; }
-    bool compare_exchange_strong(T & expected, T desired) {
+    T exchange(T desired, int = memory_order_seq_cst) { T old = m_value; m_value = desired; return old; }
+    bool compare_exchange_strong(T & expected, T desired, int = memory_order_seq_cst, int = memory_order_seq_cst) {
         if (m_value == expected) {
             m_value = desired;
             return true;
@@ -111,6 +111,9 @@ public:
             return false;
         }
     }
+    bool compare_exchange_weak(T & expected, T desired, int success = memory_order_seq_cst, int failure = memory_order_seq_cst) {
+        return compare_exchange_strong(expected, desired, success, failure);
+    }
 };
 typedef atomic<unsigned short> atomic_ushort;
 typedef atomic<unsigned char>  atomic_uchar;
@@ -6,12 +6,27 @@ Authors: Leonardo de Moura, Gabriel Ebner, Sebastian Ullrich
 */
 #include <unordered_map>
 #include <vector>
+#include <memory>
 #include <utility>
 #include <string>
 #include <sstream>
 #include <fstream>
 #include <algorithm>
 #include <sys/stat.h>
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+// see `mmap_olean_lazy`
+#define LEAN_LAZY_RELOCATION
+#endif
+#endif
+#if defined(LEAN_ZLIB)
+#include <zlib.h>
+#endif
+#include <lean/alloc.h>
 #include <lean/thread.h>
 #include <lean/interrupt.h>
 #include <lean/sstream.h>
@@ -19,6 +34,7 @@ Authors: Leonardo de Moura, Gabriel Ebner, Sebastian Ullrich
 #include <lean/io.h>
 #include <lean/compact.h>
 #include "util/io.h"
+#include "util/name.h"
 #include "util/buffer.h"
 #include "util/name_map.h"
 #include "util/file_lock.h"
@@ -26,6 +42,7 @@ Authors: Leonardo de Moura, Gabriel Ebner, Sebastian Ullrich
 #include "library/constants.h"
 #include "library/time_task.h"
 #include "library/util.h"
+#include "githash.h" // NOLINT
 
 #if defined(__has_feature)
 #if __has_feature(address_sanitizer)
@@ -34,29 +51,873 @@ Authors: Leonardo de Moura, Gabriel Ebner, Sebastian Ullrich
 #endif
 
 namespace lean {
-// manually padded to multiple of word size, see `initialize_module`
-static char const * g_olean_header   = "oleanfile!!!!!!!";
+/* Header of .olean files. The payload, a compacted object graph, is stored right after it, see `olean_compression`.
+   It is followed by `num_imports` entries of type `olean_import`, the references to each imported payload, and
+   `num_blocks` block offsets, see `g_olean_block_size`. */
+struct olean_header {
+    char   marker[5] = {'o', 'l', 'e', 'a', 'n'};
+    /* Make sure to bump the version whenever the layout of the header or the payload changes. The stdlib of stage 1 is
+       written by stage 0, so the format written by stage 0 must remain readable until stage 0 is updated. Currently,
+       this is the format preceding `olean_header`, see `g_olean_v0_marker`. Stage 0 does not know its commit, see
+       `is_foreign_olean_githash`. */
+    uint8  version = 7;
+    // `olean_compression` of the payload
+    uint8  compression = 0;
+    char   padding = 0;
+    // `LEAN_GITHASH` of the Lean version that wrote the file, see `CHECK_OLEAN_VERSION` and `set_olean_githash`
+    char   githash[40] = {};
+    // address at which the beginning of the file (including the header) is attempted to be mmapped
+    size_t base_addr;
+    // hash of the uncompressed payload, used to check whether data derived from the file is still up to date
+    uint64 data_hash;
+    // checksum of the remainder of the file, see `checksum_olean`
+    uint64 checksum;
+    // size of the uncompressed payload
+    size_t payload_size;
+    // size of the payload as stored in the file
+    size_t stored_size;
+    size_t num_imports = 0;
+    size_t num_blocks = 0;
+};
+// the payload must be correctly aligned for Lean objects
+static_assert(sizeof(olean_header) % sizeof(void *) == 0, "olean_header must be padded to a multiple of the word size");
+
+/* Payload of an imported module referenced by the payload of an .olean file instead of copying its objects, see
+   `object_compactor::add_import_region`. References are stored as if the imported payload was located at its
+   base address. */
+struct olean_import {
+    size_t base_addr;
+    size_t size;
+    // `olean_header::data_hash` of the imported module
+    uint64 data_hash;
+    // number of references, their offsets in the payload follow the `olean_import` entries as `uint64` values
+    uint64 num_refs;
+};
+
+enum class olean_compression : uint8 {
+    // the payload is stored as is, so that the file can be mapped into memory
+    none = 0,
+    /* The payload is split into chunks of equal size, which are compressed independently using zlib so that they can
+       be decompressed in parallel. The stored payload starts with the `uint64` chunk size, followed by an
+       `olean_chunk` for each chunk and the compressed chunks. */
+    zlib = 1,
+};
+
+struct olean_chunk {
+    // position of the compressed chunk relative to the beginning of the stored payload
+    uint64 offset;
+    uint64 size;
+};
+
+/* The uncompressed file is divided into blocks of this size, which can be relocated independently of each other,
+   see `mmap_olean_lazy`. For each block, the file stores the `uint64` offset in the payload of the object
+   containing its first byte, or 0 for the first block. Must be a multiple of the page size. */
+static const size_t g_olean_block_size = 64 * 1024;
+
+#if defined(LEAN_LAZY_RELOCATION)
+class olean_region;
+
+/* See `mmap_olean_lazy`. As this is accessed by `lazy_relocation_handler`, the fields that may change after the
+   region has been registered are only accessed using atomic operations. */
+struct lazy_relocation {
+    enum block_state : unsigned char { block_unrelocated, block_relocating, block_relocated };
+    olean_region *       m_region;
+    // private mapping of the file before relocation
+    char const *         m_src;
+    size_t               m_src_size;
+    // header and relocated payload as accessed by Lean, accessible only in blocks that have been relocated
+    char *               m_view;
+    // writable view of the same memory, used for relocating blocks before making them accessible
+    char *               m_rw_view;
+    size_t               m_view_size;
+    uint64 const *       m_blocks;
+    // `block_state` of each block
+    std::unique_ptr<atomic_uchar[]> m_block_state;
+    // next registered region, see `g_lazy_regions`
+    atomic<lazy_relocation *> m_next{nullptr};
+};
+#endif
+
+/* Compacted region of an .olean file. */
+class olean_region : public compacted_region {
+    std::string               m_fname;
+    uint64                    m_data_hash;
+    std::vector<olean_import> m_imports;
+    /* Offsets of the references to imported payloads, in the order of `m_imports`. */
+    uint64 const *            m_refs = nullptr;
+    std::vector<uint64>       m_refs_storage;
+    /* Read-only mapping containing the payload, see `link`. */
+    void *                    m_ro_map = nullptr;
+    size_t                    m_ro_map_size = 0;
+#if defined(LEAN_LAZY_RELOCATION)
+    std::unique_ptr<lazy_relocation> m_lazy;
+#endif
+public:
+    olean_region(std::string const & fname, uint64 data_hash, size_t sz, void * data, void * base_addr,
+                 std::function<void()> const & free_data, compacted_region_format format):
+        compacted_region(sz, data, base_addr, free_data, format), m_fname(fname), m_data_hash(data_hash) {}
+    virtual ~olean_region();
+    uint64 data_hash() const { return m_data_hash; }
+    /* `refs` must remain valid as long as the region. */
+    void set_imports(std::vector<olean_import> const & imports, uint64 const * refs) {
+        m_imports = imports;
+        m_refs    = refs;
+        if (!imports.empty())
+            set_has_imports();
+    }
+    void set_imports(std::vector<olean_import> const & imports, std::vector<uint64> && refs) {
+        m_refs_storage = std::move(refs);
+        set_imports(imports, m_refs_storage.data());
+    }
+    void set_read_only_map(void * map, size_t size) {
+        m_ro_map      = map;
+        m_ro_map_size = size;
+    }
+    /* Check that the imported payloads referenced by this region are among `loaded` (indexed by their data hash),
+       and relocate the references to payloads that are not located at their base address. */
+    void link(std::unordered_multimap<uint64, olean_region const *> const & loaded);
+#if defined(LEAN_LAZY_RELOCATION)
+    void set_lazy_relocation(std::unique_ptr<lazy_relocation> && lazy);
+    /* Relocate the block containing `addr` unless it has already been relocated. Return false if `addr` does not
+       belong to the lazily relocated payload. As this is called by `lazy_relocation_handler`, it only reads the
+       private mapping of the file and writes the writable view, neither of which can fault. */
+    bool relocate_on_access(void const * addr);
+#endif
+};
+
+/* Marker of .olean files produced before `olean_header` was introduced, including the ones written by stage 0. Their
+   payload uses `compacted_region_format::v0` and starts right after the marker. */
+static char const g_olean_v0_marker[16] = {'o', 'l', 'e', 'a', 'n', 'f', 'i', 'l', 'e', '!', '!', '!', '!', '!', '!', '!'};
+static_assert(sizeof(g_olean_v0_marker) <= sizeof(olean_header), "unexpected olean_header size");
+
+/* Store `LEAN_GITHASH` in `githash`. It is left zeroed by builds that do not know their commit, such as stage 0, which
+   is built with `USE_GITHASH=OFF`. */
+static void set_olean_githash(char * githash, size_t size) {
+    if (strcmp(LEAN_GITHASH, "GITDIR-NOTFOUND") != 0)
+        memcpy(githash, LEAN_GITHASH, std::min(strlen(LEAN_GITHASH), size));
+}
+
+#if !defined(LEAN_IGNORE_OLEAN_VERSION)
+/* Return true if the .olean file with the given `olean_header::githash` may have been written by a different version
+   of Lean. Files written by builds that do not know their commit are accepted, so that the stdlib of stage 1, which
+   is written by stage 0, can be read with `CHECK_OLEAN_VERSION` enabled. */
+static bool is_foreign_olean_githash(char const * githash, char const * current, size_t size) {
+    if (std::all_of(githash, githash + size, [](char c) { return c == 0; }))
+        return false;
+    return memcmp(githash, current, size) != 0;
+}
+#endif
+
+static size_t get_olean_num_blocks(size_t payload_size) {
+    return (sizeof(olean_header) + payload_size + g_olean_block_size - 1) / g_olean_block_size;
+}
+
+/* Compute the block offsets of the compacted payload `data`, see `g_olean_block_size`. */
+static std::vector<uint64> get_olean_blocks(void const * data, size_t size) {
+    std::vector<uint64> blocks;
+    blocks.push_back(0);
+    size_t next_block = g_olean_block_size;
+    size_t file_size  = sizeof(olean_header) + size;
+    size_t off = 0;
+    while (off < size) {
+        object * o = reinterpret_cast<object *>(static_cast<char *>(const_cast<void *>(data)) + off);
+        size_t obj_end = sizeof(olean_header) + off + compacted_region::object_byte_size(o);
+        for (; next_block < obj_end && next_block < file_size; next_block += g_olean_block_size)
+            blocks.push_back(off);
+        off = obj_end - sizeof(olean_header);
+    }
+    lean_assert(blocks.size() == get_olean_num_blocks(size));
+    return blocks;
+}
+
+/* Check that the block offsets `blocks` of a payload of size `data_size` are plausible, i.e. that the object
+   containing the first byte of each block does not start after it. */
+static bool check_olean_blocks(uint64 const * blocks, size_t num_blocks, size_t data_size) {
+    for (size_t i = 0; i < num_blocks; i++) {
+        if ((data_size > 0 && blocks[i] >= data_size) || sizeof(olean_header) + blocks[i] > std::max(i * g_olean_block_size, sizeof(olean_header)))
+            return false;
+    }
+    return true;
+}
+
+/*
+  Derive a base address for a memory-mapped file from the hash `h`. It is deterministic, so that all processes attempt
+  to map a file at the same address, and should be reasonably well-distributed, so that files mapped by the same
+  process do not overlap. An overlapping or unavailable base address does not prevent the file from being used,
+  it merely prevents us from using `mmap` without relocations for it. Return 0 if not supported on this platform. */
+static size_t get_base_addr(uint64 h) {
+#if defined(LEAN_WINDOWS) || defined(LEAN_EMSCRIPTEN)
+    (void)h;
+    return 0;
+#else
+    if (sizeof(void *) < 8)
+        return 0;
+    // x86-64 user space is limited to the lower 47 bits, and the stack and shared libraries are located near the top
+    // of it, while the executable and the `malloc` heap are located near the bottom. Thus, we use [2^40, 2^46).
+    const size_t min_addr = static_cast<size_t>(1) << 40;
+    const size_t max_addr = static_cast<size_t>(1) << 46;
+    size_t base_addr = min_addr + static_cast<size_t>(h) % (max_addr - min_addr);
+    // `mmap` addresses must be page-aligned, use a conservative alignment of 64KB
+    const size_t align = static_cast<size_t>(1) << 16;
+    return base_addr & ~(align - 1);
+#endif
+}
+
+/* Derive the base address of the .olean file of module `mod`, see `get_base_addr`. */
+static size_t get_olean_base_addr(name const & mod) {
+    return get_base_addr(name::hash(mod.raw()));
+}
+
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+static bool pwrite_all(int fd, void const * data, size_t size, size_t pos) {
+    char const * it = static_cast<char const *>(data);
+    while (size > 0) {
+        ssize_t n = pwrite(fd, it, size, pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        it   += n;
+        pos  += n;
+        size -= n;
+    }
+    return true;
+}
+#endif
+
+/* Number of threads currently spawned by `parallel_for`. Modules are read concurrently (see `readModules`), so the
+   threads of all invocations together are bounded by `hardware_concurrency()`. */
+static atomic<unsigned> g_parallel_for_threads(0);
+
+/* Run `fn(i)` for each `i < n` using the current thread and, as long as fewer than `hardware_concurrency()` threads
+   are spawned by other invocations, up to `hardware_concurrency() - 1` additional threads. `fn` must not throw. */
+static void parallel_for(size_t n, std::function<void(size_t)> const & fn) {
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        size_t i;
+        while ((i = atomic_fetch_add_explicit(&next, static_cast<size_t>(1), memory_order_relaxed)) < n)
+            fn(i);
+    };
+    unsigned max_threads = std::max(hardware_concurrency(), 1u);
+    size_t num_threads = std::min(static_cast<size_t>(max_threads), n);
+    std::vector<std::unique_ptr<lthread>> threads;
+    for (size_t i = 1; i < num_threads; i++) {
+        unsigned spawned = g_parallel_for_threads.load();
+        while (spawned + 1 < max_threads && !g_parallel_for_threads.compare_exchange_weak(spawned, spawned + 1)) {}
+        if (spawned + 1 >= max_threads)
+            break;
+        threads.emplace_back(new lthread(worker));
+    }
+    worker();
+    for (auto & t : threads)
+        t->join();
+    g_parallel_for_threads -= threads.size();
+}
+
+// size of the chunks of .olean files hashed independently of each other, see `checksum_olean`
+static const size_t g_olean_checksum_chunk_size = 4 * 1024 * 1024;
+
+/* Compute the checksum of the part of an .olean file following the header. The chunks are hashed in parallel,
+   and the checksum is the hash of their hashes. If given, `then(begin, end)` is invoked by the thread that hashed the
+   chunk `[begin, end)` right after hashing it, and may modify it. */
+static uint64 checksum_olean(char const * data, size_t size,
+                             std::function<void(size_t, size_t)> const & then = nullptr) {
+    size_t num_chunks = (size + g_olean_checksum_chunk_size - 1) / g_olean_checksum_chunk_size;
+    std::vector<uint64> hashes(num_chunks);
+    parallel_for(num_chunks, [&](size_t i) {
+        size_t begin = i * g_olean_checksum_chunk_size;
+        size_t end   = std::min(begin + g_olean_checksum_chunk_size, size);
+        hashes[i] = hash_bytes64(end - begin, data + begin, i);
+        if (then)
+            then(begin, end);
+    });
+    return hash_bytes64(sizeof(uint64) * hashes.size(), reinterpret_cast<char const *>(hashes.data()), size);
+}
+
+/* Compute `olean_header::data_hash`. References to imported payloads (see `olean_import`) and import indices (see
+   `import_index_entry`) are trusted if the hash of the referenced payload matches, so it must be a full 64-bit hash. */
+static uint64 hash_olean_data(void const * data, size_t size) {
+    return checksum_olean(static_cast<char const *>(data), size);
+}
 
-extern "C" object * lean_save_module_data(object * fname, object * mdata, object *) {
+/* Check the checksum of the part `data` of the .olean file following the header, see `checksum_olean` for `then`.
+   Files written before `olean_header` was introduced do not have a checksum. */
+static void check_olean_checksum(olean_header const & header, compacted_region_format format, char const * data, size_t size,
+                                 std::function<void(size_t, size_t)> const & then = nullptr) {
+    if (format != compacted_region_format::v0 && checksum_olean(data, size, then) != header.checksum)
+        throw exception("the file is corrupted, checksum mismatch");
+}
+
+#if defined(LEAN_ZLIB)
+// size of the uncompressed chunks of compressed .olean files
+static const size_t g_olean_chunk_size = 4 * 1024 * 1024;
+
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+/* Return the zlib compression level for new .olean files set by the environment variable `LEAN_OLEAN_COMPRESS`,
+   or 0 if they should not be compressed. Any value other than `0` and the levels `1` to `9` selects zlib's default
+   level. */
+static int get_olean_compression_level() {
+    char const * val = getenv("LEAN_OLEAN_COMPRESS");
+    if (!val || !*val || strcmp(val, "0") == 0)
+        return 0;
+    int level = atoi(val);
+    return 1 <= level && level <= 9 ? level : Z_DEFAULT_COMPRESSION;
+}
+
+/* Write `data` compressed using `olean_compression::zlib` to position `pos` of `fd`, and return the stored size. As
+   `data` may be a mapping of the same file region, all chunks are compressed before writing any of them. */
+static size_t write_compressed_payload(int fd, char const * data, size_t size, int level, size_t pos) {
+    size_t num_chunks = (size + g_olean_chunk_size - 1) / g_olean_chunk_size;
+    std::vector<std::vector<Bytef>> chunks(num_chunks);
+    atomic<bool> ok(true);
+    parallel_for(num_chunks, [&](size_t i) {
+        size_t begin = i * g_olean_chunk_size;
+        uLong  n     = std::min(g_olean_chunk_size, size - begin);
+        uLongf compressed_size = compressBound(n);
+        chunks[i].resize(compressed_size);
+        if (compress2(chunks[i].data(), &compressed_size, reinterpret_cast<Bytef const *>(data + begin), n, level) != Z_OK)
+            ok = false;
+        chunks[i].resize(compressed_size);
+    });
+    if (!ok)
+        throw exception("failed to compress .olean payload");
+    uint64 chunk_size = g_olean_chunk_size;
+    std::vector<olean_chunk> index;
+    uint64 offset = sizeof(uint64) + sizeof(olean_chunk) * num_chunks;
+    for (auto const & chunk : chunks) {
+        index.push_back(olean_chunk { offset, chunk.size() });
+        offset += chunk.size();
+    }
+    if (!pwrite_all(fd, &chunk_size, sizeof(uint64), pos)
+        || !pwrite_all(fd, index.data(), sizeof(olean_chunk) * index.size(), pos + sizeof(uint64)))
+        throw exception(sstream() << "failed to write file: " << strerror(errno));
+    for (size_t i = 0; i < num_chunks; i++) {
+        if (!pwrite_all(fd, chunks[i].data(), chunks[i].size(), pos + index[i].offset))
+            throw exception(sstream() << "failed to write file: " << strerror(errno));
+    }
+    // keep the entries following the payload aligned
+    return (offset + sizeof(uint64) - 1) & ~(sizeof(uint64) - 1);
+}
+#endif
+
+/* Decompress the payload `stored` of an .olean file with the given header, of size `header.stored_size`, into
+   `data`, which must have room for `header.payload_size` bytes. */
+static void decompress_payload(olean_header const & header, char const * stored, char * data) {
+    uint64 chunk_size;
+    size_t stored_size = header.stored_size;
+    if (stored_size < sizeof(uint64))
+        throw exception("invalid compressed payload");
+    memcpy(&chunk_size, stored, sizeof(uint64));
+    if (chunk_size == 0)
+        throw exception("invalid compressed payload");
+    size_t num_chunks = (header.payload_size + chunk_size - 1) / chunk_size;
+    if (num_chunks > (stored_size - sizeof(uint64)) / sizeof(olean_chunk))
+        throw exception("invalid compressed payload");
+    std::vector<olean_chunk> index(num_chunks);
+    memcpy(index.data(), stored + sizeof(uint64), sizeof(olean_chunk) * num_chunks);
+    for (olean_chunk const & chunk : index) {
+        if (chunk.offset > stored_size || chunk.size > stored_size - chunk.offset)
+            throw exception("invalid compressed payload");
+    }
+    atomic<bool> ok(true);
+    parallel_for(num_chunks, [&](size_t i) {
+        size_t begin = i * chunk_size;
+        uLongf n     = std::min(static_cast<size_t>(chunk_size), header.payload_size - begin);
+        uLongf expected_size = n;
+        if (uncompress(reinterpret_cast<Bytef *>(data + begin), &n,
+                       reinterpret_cast<Bytef const *>(stored + index[i].offset), index[i].size) != Z_OK
+            || n != expected_size)
+            ok = false;
+    });
+    if (!ok)
+        throw exception("invalid compressed payload");
+}
+#endif
+
+static olean_region const * get_olean_region(b_obj_arg regions, size_t i) {
+    return static_cast<olean_region const *>(reinterpret_cast<compacted_region const *>(unbox_size_t(array_get(regions, i))));
+}
+
+static bool ranges_overlap(size_t begin1, size_t size1, size_t begin2, size_t size2) {
+    return begin1 < begin2 + size2 && begin2 < begin1 + size1;
+}
+
+/* Register the payloads of `regions` that have a base address with `compactor`, skipping ones whose base address
+   ranges overlap. */
+static std::vector<olean_region const *> add_olean_imports(object_compactor & compactor, b_obj_arg regions) {
+    std::vector<olean_region const *> result;
+    for (size_t i = 0; i < array_size(regions); i++) {
+        olean_region const * r = get_olean_region(regions, i);
+        size_t base_addr = reinterpret_cast<size_t>(r->base_addr());
+        if (base_addr == 0)
+            continue;
+        bool overlaps = false;
+        for (olean_region const * r2 : result) {
+            if (ranges_overlap(base_addr, r->size(), reinterpret_cast<size_t>(r2->base_addr()), r2->size()))
+                overlaps = true;
+        }
+        if (overlaps)
+            continue;
+        compactor.add_import_region(r->data(), static_cast<char const *>(r->data()) + r->size(), r->base_addr());
+        result.push_back(r);
+    }
+    return result;
+}
+
+/* Collect the imported payloads actually referenced by the compacted payload at `base_addr`. Return false if the
+   payload overlaps one of them, in which case references to it cannot be distinguished when reading it. */
+static bool collect_olean_imports(object_compactor const & compactor, std::vector<olean_region const *> const & candidates,
+                                  char const * base_addr, std::vector<olean_import> & imports, std::vector<uint64> & refs) {
+    for (olean_region const * r : candidates) {
+        std::vector<size_t> const & r_refs = compactor.get_import_refs(r->data());
+        if (r_refs.empty())
+            continue;
+        size_t r_base_addr = reinterpret_cast<size_t>(r->base_addr());
+        if (ranges_overlap(r_base_addr, r->size(), reinterpret_cast<size_t>(base_addr), compactor.size()))
+            return false;
+        imports.push_back(olean_import { r_base_addr, r->size(), r->data_hash(), r_refs.size() });
+        refs.insert(refs.end(), r_refs.begin(), r_refs.end());
+    }
+    return true;
+}
+
+/* saveModuleData (fname : @& FilePath) (mod : @& Name) (imports : @& Array CompactedRegion) (m : ModuleData) : IO Unit */
+extern "C" object * lean_save_module_data(b_obj_arg fname, b_obj_arg mod, b_obj_arg imports, object * mdata, object *) {
     std::string olean_fn(string_cstr(fname));
+    // we first write to a temporary file and then move it into place, so that processes that are
+    // currently mapping the old version of the file are not affected
+    std::string olean_tmp_fn = olean_fn + ".tmp";
     object_ref mdata_ref(mdata);
     try {
         exclusive_file_lock output_lock(olean_fn);
-        std::ofstream out(olean_fn, std::ios_base::binary);
+        olean_header header;
+        set_olean_githash(header.githash, sizeof(header.githash));
+        header.base_addr = get_olean_base_addr(name(mod, true));
+        char * base_addr = reinterpret_cast<char *>(header.base_addr) + sizeof(olean_header);
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+        /* Stream the payload into the file while compacting it, so that we do not need an in-memory copy of the
+           whole payload in addition to the module data. The header depends on the payload and is written last. */
+        int fd = open(olean_tmp_fn.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1) {
+            return io_result_mk_error((sstream() << "failed to create file '" << olean_fn << "'").str());
+        }
+        bool ok;
+        try {
+            std::vector<olean_import> olean_imports;
+            std::vector<uint64> refs;
+            std::vector<uint64> blocks;
+            bool share = true;
+            while (true) {
+                object_compactor compactor(base_addr, fd, sizeof(olean_header));
+                std::vector<olean_region const *> candidates;
+                if (share)
+                    candidates = add_olean_imports(compactor, imports);
+                // the list of imports is read before the imported modules are loaded, see `importModules`
+                compactor.copy_local(cnstr_get(mdata_ref.raw(), 0));
+                compactor(mdata_ref.raw());
+                if (!collect_olean_imports(compactor, candidates, base_addr, olean_imports, refs)) {
+                    // extremely unlikely, just copy all objects instead
+                    share = false;
+                    olean_imports.clear();
+                    refs.clear();
+                    if (ftruncate(fd, 0) != 0)
+                        throw exception(sstream() << "failed to truncate file: " << strerror(errno));
+                    continue;
+                }
+                header.data_hash    = hash_olean_data(compactor.data(), compactor.size());
+                header.payload_size = compactor.size();
+                header.stored_size  = compactor.size();
+                header.num_imports  = olean_imports.size();
+                blocks = get_olean_blocks(compactor.data(), compactor.size());
+                header.num_blocks   = blocks.size();
+#if defined(LEAN_ZLIB)
+                if (int level = get_olean_compression_level()) {
+                    // replace the streamed payload; the file is truncated to the final size below
+                    header.compression = static_cast<uint8>(olean_compression::zlib);
+                    header.stored_size = write_compressed_payload(fd, static_cast<char const *>(compactor.data()),
+                                                                  compactor.size(), level, sizeof(olean_header));
+                }
+#endif
+                break;
+            }
+            size_t imports_pos = sizeof(olean_header) + header.stored_size;
+            size_t refs_pos    = imports_pos + sizeof(olean_import) * olean_imports.size();
+            size_t blocks_pos  = refs_pos + sizeof(uint64) * refs.size();
+            size_t end_pos     = blocks_pos + sizeof(uint64) * blocks.size();
+            ok = pwrite_all(fd, olean_imports.data(), sizeof(olean_import) * olean_imports.size(), imports_pos)
+                && pwrite_all(fd, refs.data(), sizeof(uint64) * refs.size(), refs_pos)
+                && pwrite_all(fd, blocks.data(), sizeof(uint64) * blocks.size(), blocks_pos)
+                && ftruncate(fd, end_pos) == 0;
+            if (ok) {
+                // read back the streamed payload and everything following it
+                void * file = mmap(nullptr, end_pos, PROT_READ, MAP_SHARED, fd, 0);
+                if (file == MAP_FAILED)
+                    throw exception(sstream() << "failed to map file: " << strerror(errno));
+                header.checksum = checksum_olean(static_cast<char const *>(file) + sizeof(olean_header), end_pos - sizeof(olean_header));
+                munmap(file, end_pos);
+                ok = pwrite_all(fd, &header, sizeof(header), 0);
+            }
+        } catch (...) {
+            close(fd);
+            std::remove(olean_tmp_fn.c_str());
+            throw;
+        }
+        ok = close(fd) == 0 && ok;
+        if (!ok) {
+            std::remove(olean_tmp_fn.c_str());
+            return io_result_mk_error((sstream() << "failed to write '" << olean_fn << "'").str());
+        }
+#else
+        std::ofstream out(olean_tmp_fn, std::ios_base::binary);
         if (out.fail()) {
             return io_result_mk_error((sstream() << "failed to create file '" << olean_fn << "'").str());
         }
-        object_compactor compactor;
+        (void)imports;
+        object_compactor compactor(base_addr);
         compactor(mdata_ref.raw());
-        out.write(g_olean_header, strlen(g_olean_header));
-        out.write(static_cast<char const *>(compactor.data()), compactor.size());
+        header.data_hash    = hash_olean_data(compactor.data(), compactor.size());
+        header.payload_size = compactor.size();
+        header.stored_size  = compactor.size();
+        std::vector<uint64> blocks = get_olean_blocks(compactor.data(), compactor.size());
+        header.num_blocks   = blocks.size();
+        std::string rest(static_cast<char const *>(compactor.data()), compactor.size());
+        rest.append(reinterpret_cast<char const *>(blocks.data()), sizeof(uint64) * blocks.size());
+        header.checksum     = checksum_olean(rest.data(), rest.size());
+        out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        out.write(rest.data(), rest.size());
         out.close();
+        if (out.fail()) {
+            return io_result_mk_error((sstream() << "failed to write '" << olean_fn << "'").str());
+        }
+#endif
+#if defined(LEAN_WINDOWS)
+        std::remove(olean_fn.c_str());
+#endif
+        if (std::rename(olean_tmp_fn.c_str(), olean_fn.c_str()) != 0) {
+            return io_result_mk_error((sstream() << "failed to write '" << olean_fn << "': " << strerror(errno)).str());
+        }
         return io_result_mk_ok(box(0));
     } catch (exception & ex) {
         return io_result_mk_error((sstream() << "failed to write '" << olean_fn << "': " << ex.what()).str());
     }
 }
 
+static object * mk_module_region(compacted_region * region) {
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+    // do not report as leak
+    __lsan_ignore_object(region);
+#endif
+#endif
+    object * mod = region->read();
+    object * mod_region = alloc_cnstr(0, 2, 0);
+    cnstr_set(mod_region, 0, mod);
+    cnstr_set(mod_region, 1, box_size_t(reinterpret_cast<size_t>(region)));
+    return mod_region;
+}
+
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+/* Return true if the checksums of mapped .olean files should be checked, which can be disabled by setting the
+   environment variable `LEAN_OLEAN_VERIFY` to `0`. This reads the whole file instead of only the pages that are
+   accessed. Payloads that are copied into memory anyway are always checked. */
+static bool check_mapped_olean_checksums() {
+    char const * val = std::getenv("LEAN_OLEAN_VERIFY");
+    return !val || strcmp(val, "0") != 0;
+}
+#endif
+
+#if defined(LEAN_LAZY_RELOCATION)
+/* List of lazily relocated regions. As it is traversed by `lazy_relocation_handler`, which must not take any locks,
+   it is updated using atomic operations. `g_lazy_regions_mutex` only serializes the updates. */
+static atomic<lazy_relocation *>   g_lazy_regions{nullptr};
+static mutex                       g_lazy_regions_mutex;
+/* Number of threads currently executing `lazy_relocation_handler`. Regions removed from `g_lazy_regions` are only
+   freed when it is zero, see `~olean_region`. */
+static atomic<unsigned>            g_lazy_handlers_active{0};
+static bool                        g_lazy_relocation_handler_installed = false;
+static struct sigaction            g_prev_segv_action;
+
+/* Relocate the blocks of lazily relocated regions when they are first accessed, see `mmap_olean_lazy`. Other
+   faults are passed on to the previous handler, see `stack_overflow.cpp`. As a signal handler, it must not take
+   any locks or allocate, and it must not access memory that may be protected, see `relocate_on_access`. */
+static void lazy_relocation_handler(int signum, siginfo_t * info, void * ctx) {
+    g_lazy_handlers_active++;
+    for (lazy_relocation * l = g_lazy_regions.load(); l; l = l->m_next.load()) {
+        if (l->m_region->relocate_on_access(info->si_addr)) {
+            g_lazy_handlers_active--;
+            return;
+        }
+    }
+    g_lazy_handlers_active--;
+    if (g_prev_segv_action.sa_flags & SA_SIGINFO) {
+        g_prev_segv_action.sa_sigaction(signum, info, ctx);
+    } else if (g_prev_segv_action.sa_handler != SIG_DFL && g_prev_segv_action.sa_handler != SIG_IGN) {
+        g_prev_segv_action.sa_handler(signum);
+    } else {
+        // returning executes the faulting instruction again, which now triggers the default action
+        sigaction(signum, &g_prev_segv_action, nullptr);
+    }
+}
+
+void olean_region::set_lazy_relocation(std::unique_ptr<lazy_relocation> && lazy) {
+    m_lazy = std::move(lazy);
+    m_lazy->m_region = this;
+    set_relocated_on_access();
+    lock_guard<mutex> lock(g_lazy_regions_mutex);
+    if (!g_lazy_relocation_handler_installed) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(struct sigaction));
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        action.sa_sigaction = lazy_relocation_handler;
+        sigaction(SIGSEGV, &action, &g_prev_segv_action);
+        g_lazy_relocation_handler_installed = true;
+    }
+    m_lazy->m_next.store(g_lazy_regions.load());
+    g_lazy_regions.store(m_lazy.get());
+}
+
+bool olean_region::relocate_on_access(void const * addr) {
+    lazy_relocation & l = *m_lazy;
+    size_t pos = reinterpret_cast<size_t>(addr) - reinterpret_cast<size_t>(l.m_view);
+    if (pos >= l.m_view_size)
+        return false;
+    size_t i = pos / g_olean_block_size;
+    atomic_uchar & state = l.m_block_state[i];
+    unsigned char expected = lazy_relocation::block_unrelocated;
+    if (state.compare_exchange_strong(expected, lazy_relocation::block_relocating)) {
+        size_t begin = i * g_olean_block_size;
+        size_t end   = std::min(begin + g_olean_block_size, l.m_view_size);
+        size_t header_size = sizeof(olean_header);
+        if (begin == 0)
+            memcpy(l.m_rw_view, l.m_src, header_size);
+        if (end > header_size)
+            relocate_block(l.m_src + header_size, l.m_rw_view + header_size, l.m_blocks[i],
+                           std::max(begin, header_size) - header_size, end - header_size);
+        // relocated objects are writable as with `mmap_olean`, see `link`
+        if (mprotect(l.m_view + begin, end - begin, PROT_READ | PROT_WRITE) != 0) {
+            state.store(lazy_relocation::block_unrelocated);
+            return false;
+        }
+        state.store(lazy_relocation::block_relocated);
+    } else {
+        // another thread is relocating the block, retrying the access before it is done would fault again
+        while (state.load() == lazy_relocation::block_relocating) {}
+    }
+    return true;
+}
+
+static bool use_lazy_relocation() {
+    char const * val = std::getenv("LEAN_OLEAN_LAZY_RELOCATION");
+    return val && *val && strcmp(val, "0") != 0;
+}
+
+/*
+  Map the .olean file `fd` if it cannot be mapped at its base address, relocating each block of the payload (see
+  `g_olean_block_size`) only when it is first accessed instead of relocating the whole payload when reading it.
+  Thus, only the parts of imported modules that are actually used, such as the values of some declarations, are
+  touched. The relocated payload is stored in a memory file that is mapped twice: objects are accessed through
+  a view that is inaccessible except for the blocks that have been relocated, which triggers
+  `lazy_relocation_handler`, and blocks are relocated through a writable view before they are made accessible,
+  so that other threads never observe a partially relocated block. Return `nullptr` if this is not possible.
+
+  Remark: system calls fail instead of triggering the handler when passed memory of blocks that have not been
+  accessed yet, e.g. when writing a string of the payload to a file. Thus, lazy relocation is only used if the
+  environment variable `LEAN_OLEAN_LAZY_RELOCATION` is set. */
+static olean_region * mmap_olean_lazy(std::string const & olean_fn, int fd, size_t size, size_t data_size,
+                                      char * base_addr, olean_header const & header,
+                                      std::vector<olean_import> const & imports, size_t refs_pos, size_t blocks_pos) {
+    if (g_olean_block_size % static_cast<size_t>(sysconf(_SC_PAGESIZE)) != 0)
+        return nullptr;
+    size_t view_size = sizeof(olean_header) + data_size;
+    void * src = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (src == MAP_FAILED)
+        return nullptr;
+    if (check_mapped_olean_checksums()) {
+        try {
+            check_olean_checksum(header, compacted_region_format::v1, static_cast<char const *>(src) + sizeof(olean_header),
+                                 size - sizeof(olean_header));
+        } catch (...) {
+            munmap(src, size);
+            throw;
+        }
+    }
+    uint64 const * blocks = reinterpret_cast<uint64 const *>(static_cast<char *>(src) + blocks_pos);
+    if (!check_olean_blocks(blocks, header.num_blocks, data_size)) {
+        // invalid block offsets, relocate eagerly instead
+        munmap(src, size);
+        return nullptr;
+    }
+    void * view    = MAP_FAILED;
+    void * rw_view = MAP_FAILED;
+    int mem_fd = memfd_create(olean_fn.c_str(), MFD_CLOEXEC);
+    if (mem_fd != -1) {
+        if (ftruncate(mem_fd, view_size) == 0) {
+            view    = mmap(nullptr, view_size, PROT_NONE, MAP_SHARED, mem_fd, 0);
+            rw_view = mmap(nullptr, view_size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+        }
+        close(mem_fd);
+    }
+    if (view == MAP_FAILED || rw_view == MAP_FAILED) {
+        if (view != MAP_FAILED)
+            munmap(view, view_size);
+        if (rw_view != MAP_FAILED)
+            munmap(rw_view, view_size);
+        munmap(src, size);
+        return nullptr;
+    }
+    std::unique_ptr<lazy_relocation> lazy(new lazy_relocation());
+    lazy->m_src       = static_cast<char const *>(src);
+    lazy->m_src_size  = size;
+    lazy->m_view      = static_cast<char *>(view);
+    lazy->m_rw_view   = static_cast<char *>(rw_view);
+    lazy->m_view_size = view_size;
+    lazy->m_blocks    = blocks;
+    lazy->m_block_state.reset(new atomic_uchar[header.num_blocks]);
+    for (size_t i = 0; i < header.num_blocks; i++)
+        lazy->m_block_state[i].store(lazy_relocation::block_unrelocated);
+    char * data = static_cast<char *>(view) + sizeof(olean_header);
+    olean_region * region = new olean_region(olean_fn, header.data_hash, data_size, data, base_addr,
+                                             [=]() { munmap(view, view_size); munmap(rw_view, view_size); munmap(src, size); },
+                                             compacted_region_format::v1);
+    region->set_imports(imports, reinterpret_cast<uint64 const *>(static_cast<char *>(src) + refs_pos));
+    region->set_lazy_relocation(std::move(lazy));
+    return region;
+}
+#endif
+
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+/*
+  Map the .olean file into memory. Mapped pages are loaded lazily and shared with all other processes mapping
+  the same file. We first try to map the file at its base address, in which case no relocations are necessary.
+  Otherwise, we map the file at an arbitrary address, and the payload is relocated in place. As the mapping is
+  private, relocation only copies the pages containing pointers, while pages consisting solely of scalar data
+  (e.g., strings) stay shared. Return `nullptr` if the file cannot be mapped. */
+static olean_region * mmap_olean(std::string const & olean_fn, size_t size, size_t header_size, size_t data_size,
+                                 char * base_addr, compacted_region_format format, olean_header const & header,
+                                 std::vector<olean_import> const & imports, size_t refs_pos, size_t blocks_pos) {
+    int fd = open(olean_fn.c_str(), O_RDONLY);
+    if (fd == -1)
+        return nullptr;
+    void * buffer = MAP_FAILED;
+    if (base_addr) {
+        char * file_addr = base_addr - header_size;
+#ifdef MAP_FIXED_NOREPLACE
+        int flags = MAP_PRIVATE | MAP_FIXED_NOREPLACE;
+#else
+        int flags = MAP_PRIVATE;
+#endif
+        buffer = mmap(file_addr, size, PROT_READ, flags, fd, 0);
+        if (buffer != MAP_FAILED && buffer != file_addr) {
+            // `file_addr` was only used as a hint
+            munmap(buffer, size);
+            buffer = MAP_FAILED;
+        }
+    }
+    bool read_only = buffer != MAP_FAILED;
+#if defined(LEAN_LAZY_RELOCATION)
+    if (!read_only && base_addr && header.num_blocks > 0 && use_lazy_relocation()) {
+        olean_region * region = mmap_olean_lazy(olean_fn, fd, size, data_size, base_addr, header, imports, refs_pos, blocks_pos);
+        if (region) {
+            close(fd);
+            return region;
+        }
+    }
+#endif
+    if (buffer == MAP_FAILED)
+        buffer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buffer == MAP_FAILED)
+        return nullptr;
+    advise_huge_pages(buffer, size);
+    char * data = static_cast<char *>(buffer) + header_size;
+    olean_region * region = new olean_region(olean_fn, header.data_hash, data_size, data, base_addr,
+                                             [=]() { munmap(buffer, size); }, format);
+    // the references are only read if they need to be relocated
+    region->set_imports(imports, reinterpret_cast<uint64 const *>(static_cast<char *>(buffer) + refs_pos));
+    if (read_only)
+        region->set_read_only_map(buffer, size);
+    if (check_mapped_olean_checksums()) {
+        /* If the payload has to be relocated, each chunk is relocated in place by the thread that hashed it instead
+           of by `read`, so that the payload is traversed only once and relocation is parallelized as well. */
+        uint64 const * blocks = reinterpret_cast<uint64 const *>(static_cast<char *>(buffer) + blocks_pos);
+        bool relocate = !read_only && base_addr && format == compacted_region_format::v1 && header.num_blocks > 0
+            && check_olean_blocks(blocks, header.num_blocks, data_size);
+        try {
+            check_olean_checksum(header, format, data, size - header_size, [&](size_t begin, size_t end) {
+                if (relocate && begin < data_size) {
+                    size_t first_obj = blocks[(sizeof(olean_header) + begin) / g_olean_block_size];
+                    region->relocate_block(data, data, first_obj, begin, std::min(end, data_size));
+                }
+            });
+        } catch (...) {
+            delete region;
+            throw;
+        }
+        if (relocate)
+            region->set_relocated_on_access();
+    }
+    return region;
+}
+#endif
+
+#if defined(LEAN_ZLIB)
+/* Decompress the stored payload of a compressed .olean file. Where supported, we first try to decompress it into
+   memory at the base address of the file, in which case no relocations are necessary, as with `mmap_olean`. */
+static olean_region * read_compressed_olean(std::string const & olean_fn, olean_header const & header,
+                                            char const * stored, char * base_addr) {
+    size_t data_size = header.payload_size;
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+    // the header is copied as well, see `get_mapped_olean_header`
+    size_t size = sizeof(olean_header) + data_size;
+    void * buffer = MAP_FAILED;
+    if (base_addr) {
+        char * file_addr = base_addr - sizeof(olean_header);
+#ifdef MAP_FIXED_NOREPLACE
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE;
+#else
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#endif
+        buffer = mmap(file_addr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (buffer != MAP_FAILED && buffer != file_addr) {
+            munmap(buffer, size);
+            buffer = MAP_FAILED;
+        }
+    }
+    bool at_base_addr = buffer != MAP_FAILED;
+    if (buffer == MAP_FAILED)
+        buffer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+        throw exception(sstream() << "failed to allocate memory: " << strerror(errno));
+    advise_huge_pages(buffer, size);
+    memcpy(buffer, &header, sizeof(olean_header));
+    char * data = static_cast<char *>(buffer) + sizeof(olean_header);
+    try {
+        decompress_payload(header, stored, data);
+    } catch (...) {
+        munmap(buffer, size);
+        throw;
+    }
+    olean_region * region = new olean_region(olean_fn, header.data_hash, data_size, data, base_addr,
+                                             [=]() { munmap(buffer, size); }, compacted_region_format::v1);
+    // like a mapped file, the payload stays read-only unless it needs to be relocated
+    if (at_base_addr && mprotect(buffer, size, PROT_READ) == 0)
+        region->set_read_only_map(buffer, size);
+    return region;
+#else
+    // use `malloc` here as expected by `compacted_region`
+    char * buffer = static_cast<char *>(malloc(data_size));
+    try {
+        decompress_payload(header, stored, buffer);
+    } catch (...) {
+        free(buffer);
+        throw;
+    }
+    return new olean_region(olean_fn, header.data_hash, data_size, buffer, base_addr,
+                            [=]() { free(buffer); }, compacted_region_format::v1);
+#endif
+}
+#endif
+
 extern "C" object * lean_read_module_data(object * fname, object *) {
     std::string olean_fn(string_cstr(fname));
     try {
@@ -69,38 +930,335 @@ extern "C" object * lean_read_module_data(object * fname, object *) {
         in.seekg(0, in.end);
         size_t size = in.tellg();
         in.seekg(0);
-        size_t header_size = strlen(g_olean_header);
-        if (size < header_size) {
+        olean_header default_header;
+        set_olean_githash(default_header.githash, sizeof(default_header.githash));
+        olean_header header;
+        if (size < sizeof(olean_header) || !in.read(reinterpret_cast<char *>(&header), sizeof(header))) {
             return io_result_mk_error((sstream() << "failed to read file '" << olean_fn << "', invalid header").str());
         }
-        char * header = new char[header_size];
-        in.read(header, header_size);
-        if (strncmp(header, g_olean_header, header_size) != 0) {
+        compacted_region_format format;
+        size_t header_size = sizeof(olean_header);
+        size_t data_size, stored_size;
+        char * base_addr;
+        std::vector<olean_import> imports;
+        size_t refs_pos = 0, num_refs = 0, blocks_pos = 0;
+        if (memcmp(&header, g_olean_v0_marker, sizeof(g_olean_v0_marker)) == 0) {
+            format      = compacted_region_format::v0;
+            header_size = sizeof(g_olean_v0_marker);
+            data_size   = size - header_size;
+            stored_size = data_size;
+            base_addr   = nullptr;
+            header.data_hash   = 0;
+            header.compression = static_cast<uint8>(olean_compression::none);
+            header.num_blocks  = 0;
+        } else if (memcmp(header.marker, default_header.marker, sizeof(header.marker)) != 0) {
             return io_result_mk_error((sstream() << "failed to read file '" << olean_fn << "', invalid header").str());
+        } else if (header.version != default_header.version) {
+            return io_result_mk_error((sstream() << "failed to read file '" << olean_fn << "', unsupported version "
+                                       << static_cast<unsigned>(header.version)).str());
+#if !defined(LEAN_IGNORE_OLEAN_VERSION)
+        } else if (is_foreign_olean_githash(header.githash, default_header.githash, sizeof(header.githash))) {
+            return io_result_mk_error((sstream() << "failed to read file '" << olean_fn << "', it was compiled by a different "
+                                       << "version of Lean (commit " << std::string(header.githash, strnlen(header.githash, sizeof(header.githash)))
+                                       << ")").str());
+#endif
+        } else {
+            format      = compacted_region_format::v1;
+            data_size   = header.payload_size;
+            stored_size = header.stored_size;
+            base_addr   = header.base_addr == 0 ? nullptr : reinterpret_cast<char *>(header.base_addr) + sizeof(olean_header);
+            size_t imports_pos = header_size + stored_size;
+            if (stored_size > size - header_size || header.num_imports > (size - imports_pos) / sizeof(olean_import)
+                || (header.compression == static_cast<uint8>(olean_compression::none) && stored_size != data_size)) {
+                return io_result_mk_error((sstream() << "failed to read file '" << olean_fn << "', invalid header").str());
+            }
+            if (header.compression == static_cast<uint8>(olean_compression::zlib)) {
+#if !defined(LEAN_ZLIB)
+                return io_result_mk_error((sstream() << "failed to read file '" << olean_fn << "', "
+                                           << "compressed .olean files are not supported by this build of Lean").str());
+#endif
+            } else if (header.compression != static_cast<uint8>(olean_compression::none)) {
+                return io_result_mk_error((sstream() << "failed to read file '" << olean_fn << "', unsupported compression "
+                                           << static_cast<unsigned>(header.compression)).str());
+            }
+            imports.resize(header.num_imports);
+            in.seekg(imports_pos);
+            in.read(reinterpret_cast<char *>(imports.data()), sizeof(olean_import) * imports.size());
+            refs_pos = imports_pos + sizeof(olean_import) * imports.size();
+            for (olean_import const & imp : imports)
+                num_refs += imp.num_refs;
+            if (!in || num_refs > (size - refs_pos) / sizeof(uint64)) {
+                return io_result_mk_error((sstream() << "failed to read file '" << olean_fn << "', invalid header").str());
+            }
+            blocks_pos = refs_pos + sizeof(uint64) * num_refs;
+            if (header.num_blocks != get_olean_num_blocks(data_size) || header.num_blocks > (size - blocks_pos) / sizeof(uint64)) {
+                return io_result_mk_error((sstream() << "failed to read file '" << olean_fn << "', invalid header").str());
+            }
+        }
+#if defined(LEAN_ZLIB)
+        if (header.compression == static_cast<uint8>(olean_compression::zlib)) {
+            std::vector<char> rest(size - header_size);
+            in.seekg(header_size);
+            in.read(rest.data(), rest.size());
+            if (!in) {
+                return io_result_mk_error((sstream() << "failed to read file '" << olean_fn << "'").str());
+            }
+            in.close();
+            check_olean_checksum(header, format, rest.data(), rest.size());
+            uint64 const * refs_begin = reinterpret_cast<uint64 const *>(rest.data() + refs_pos - header_size);
+            std::vector<uint64> refs(refs_begin, refs_begin + num_refs);
+            olean_region * region = read_compressed_olean(olean_fn, header, rest.data(), base_addr);
+            region->set_imports(imports, std::move(refs));
+            return io_result_mk_ok(mk_module_region(region));
+        }
+#endif
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+        if (olean_region * region = mmap_olean(olean_fn, size, header_size, data_size, base_addr, format, header,
+                                               imports, refs_pos, blocks_pos)) {
+            return io_result_mk_ok(mk_module_region(region));
         }
-        delete[] header;
-        // use `malloc` here as expected by `compacted_region`
+#endif
+        // use `malloc` here as expected by `compacted_region`; the entries following the payload are kept with it
         char * buffer = static_cast<char *>(malloc(size - header_size));
+        in.seekg(header_size);
         in.read(buffer, size - header_size);
         if (!in) {
+            free(buffer);
             return io_result_mk_error((sstream() << "failed to read file '" << olean_fn << "'").str());
         }
         in.close();
-        compacted_region * region = new compacted_region(size - header_size, buffer);
-#if defined(__has_feature)
-#if __has_feature(address_sanitizer)
-        // do not report as leak
-        __lsan_ignore_object(region);
+        try {
+            check_olean_checksum(header, format, buffer, size - header_size);
+        } catch (...) {
+            free(buffer);
+            throw;
+        }
+        olean_region * region = new olean_region(olean_fn, header.data_hash, data_size, buffer, base_addr,
+                                                 [=]() { free(buffer); }, format);
+        region->set_imports(imports, reinterpret_cast<uint64 const *>(buffer + refs_pos - header_size));
+        return io_result_mk_ok(mk_module_region(region));
+    } catch (exception & ex) {
+        return io_result_mk_error((sstream() << "failed to read '" << olean_fn << "': " << ex.what()).str());
+    }
+}
+
+olean_region::~olean_region() {
+#if defined(LEAN_LAZY_RELOCATION)
+    if (m_lazy) {
+        {
+            lock_guard<mutex> lock(g_lazy_regions_mutex);
+            atomic<lazy_relocation *> * it = &g_lazy_regions;
+            while (it->load() != m_lazy.get())
+                it = &it->load()->m_next;
+            it->store(m_lazy->m_next.load());
+        }
+        // a concurrent `lazy_relocation_handler` may still be traversing the removed entry
+        while (g_lazy_handlers_active.load() != 0)
+            this_thread::yield();
+    }
 #endif
+}
+
+void olean_region::link(std::unordered_multimap<uint64, olean_region const *> const & loaded) {
+    uint64 const * refs = m_refs;
+    for (olean_import const & imp : m_imports) {
+        olean_region const * target = nullptr;
+        auto range = loaded.equal_range(imp.data_hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (reinterpret_cast<size_t>(it->second->base_addr()) == imp.base_addr && it->second->size() == imp.size)
+                target = it->second;
+        }
+        if (!target) {
+            throw exception(sstream() << "failed to read file '" << m_fname << "', "
+                            << "an imported module has changed since it was written");
+        }
+        size_t delta = reinterpret_cast<size_t>(target->data()) - imp.base_addr;
+        if (delta != 0) {
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+            if (m_ro_map) {
+                // the mapping is private, so only the pages we write to are copied
+                if (mprotect(m_ro_map, m_ro_map_size, PROT_READ | PROT_WRITE) != 0)
+                    throw exception(sstream() << "failed to relocate file '" << m_fname << "': " << strerror(errno));
+                m_ro_map = nullptr;
+            }
 #endif
-        object * mod = region->read();
-        object * mod_region = alloc_cnstr(0, 2, 0);
-        cnstr_set(mod_region, 0, mod);
-        cnstr_set(mod_region, 1, box_size_t(reinterpret_cast<size_t>(region)));
-        return io_result_mk_ok(mod_region);
+            char * data = static_cast<char *>(const_cast<void *>(this->data()));
+            for (uint64 i = 0; i < imp.num_refs; i++) {
+                size_t * ref = reinterpret_cast<size_t *>(data + refs[i]);
+                *ref += delta;
+            }
+        }
+        refs += imp.num_refs;
+    }
+}
+
+/* linkModuleRegions (regions : @& Array CompactedRegion) : IO Unit */
+extern "C" object * lean_link_module_regions(b_obj_arg regions, object *) {
+    std::unordered_multimap<uint64, olean_region const *> loaded;
+    for (size_t i = 0; i < array_size(regions); i++) {
+        olean_region const * r = get_olean_region(regions, i);
+        loaded.insert(std::make_pair(r->data_hash(), r));
+    }
+    try {
+        for (size_t i = 0; i < array_size(regions); i++)
+            const_cast<olean_region *>(get_olean_region(regions, i))->link(loaded);
     } catch (exception & ex) {
-        return io_result_mk_error((sstream() << "failed to read '" << olean_fn << "': " << ex.what()).str());
+        return io_result_mk_error(ex.what());
     }
+    return io_result_mk_ok(box(0));
+}
+
+/* Header of import index files. It is followed by an `import_index_entry` for each imported module and the payload,
+   an `ImportIndex` object (see `Environment.lean`) compacted against the base address of the file. */
+struct import_index_header {
+    char   marker[5] = {'l', 'i', 'd', 'x', '!'};
+    // make sure to bump the version whenever the layout of the header or the payload changes, see `lean_import_index_key`
+    uint8  version = 2;
+    char   padding[2] = {0, 0};
+    // address at which the beginning of the file (including the header) must be mmapped
+    size_t base_addr;
+    size_t num_modules;
+};
+
+/* The payload of an import index references objects of the imported modules, which must be mapped at these addresses. */
+struct import_index_entry {
+    // base address of the module's payload
+    size_t base_addr;
+    // `olean_header::data_hash` of the module
+    uint64 data_hash;
+};
+
+/* Return the header of the .olean file of the given module region if the file is mapped at its base address. */
+static olean_header const * get_mapped_olean_header(compacted_region const * region) {
+    if (region->base_addr() == nullptr || !region->is_at_base_addr())
+        return nullptr;
+    return reinterpret_cast<olean_header const *>(static_cast<char const *>(region->data()) - sizeof(olean_header));
+}
+
+static compacted_region const * get_region(b_obj_arg regions, size_t i) {
+    return reinterpret_cast<compacted_region const *>(unbox_size_t(array_get(regions, i)));
+}
+
+/* importIndexKey (key : UInt64) : UInt64
+
+   Mix the version of Lean and of the import index format into `key`, so that indices written by different versions of
+   Lean are stored in different files and at different base addresses. */
+extern "C" uint64 lean_import_index_key(uint64 key) {
+    import_index_header header;
+    uint64 h = hash_bytes64(strlen(LEAN_GITHASH), LEAN_GITHASH, header.version);
+    return hash(key, h);
+}
+
+/* saveImportIndex (fname : @& FilePath) (key : UInt64) (regions : @& Array CompactedRegion) (index : ImportIndex) : IO Bool */
+extern "C" object * lean_save_import_index(b_obj_arg fname, uint64 key, b_obj_arg regions, object * index, object *) {
+    object_ref index_ref(index);
+#if defined(LEAN_WINDOWS) || defined(LEAN_EMSCRIPTEN)
+    (void)fname; (void)key; (void)regions;
+    return io_result_mk_ok(box(false));
+#else
+    std::string index_fn(string_cstr(fname));
+    import_index_header header;
+    header.base_addr   = get_base_addr(key);
+    header.num_modules = array_size(regions);
+    if (header.base_addr == 0)
+        return io_result_mk_ok(box(false));
+    std::vector<import_index_entry> entries;
+    for (size_t i = 0; i < header.num_modules; i++) {
+        compacted_region const * region = get_region(regions, i);
+        olean_header const * mod_header = get_mapped_olean_header(region);
+        if (!mod_header) {
+            // the index would never be valid
+            return io_result_mk_ok(box(false));
+        }
+        entries.push_back(import_index_entry { reinterpret_cast<size_t>(region->base_addr()), mod_header->data_hash });
+    }
+    size_t header_size = sizeof(import_index_header) + sizeof(import_index_entry) * entries.size();
+    object_compactor compactor(reinterpret_cast<char *>(header.base_addr) + header_size);
+    for (size_t i = 0; i < header.num_modules; i++) {
+        compacted_region const * region = get_region(regions, i);
+        compactor.add_external_region(region->data(), static_cast<char const *>(region->data()) + region->size());
+    }
+    compactor(index_ref.raw());
+    // the index may be written concurrently by multiple processes importing the same modules
+    std::string index_tmp_fn = index_fn + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream out(index_tmp_fn, std::ios_base::binary);
+    if (out.fail()) {
+        return io_result_mk_error((sstream() << "failed to create file '" << index_fn << "'").str());
+    }
+    out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    out.write(reinterpret_cast<char const *>(entries.data()), sizeof(import_index_entry) * entries.size());
+    out.write(static_cast<char const *>(compactor.data()), compactor.size());
+    out.close();
+    if (out.fail() || std::rename(index_tmp_fn.c_str(), index_fn.c_str()) != 0) {
+        std::remove(index_tmp_fn.c_str());
+        return io_result_mk_error((sstream() << "failed to write '" << index_fn << "'").str());
+    }
+    return io_result_mk_ok(box(true));
+#endif
+}
+
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+/* Map the import index `index_fn` if it matches the given module regions. Return `nullptr` otherwise. */
+static compacted_region * mmap_import_index(std::string const & index_fn, uint64 key, b_obj_arg regions) {
+    int fd = open(index_fn.c_str(), O_RDONLY);
+    if (fd == -1)
+        return nullptr;
+    auto fail = [&]() { close(fd); return nullptr; };
+    import_index_header default_header;
+    import_index_header header;
+    struct stat st;
+    if (fstat(fd, &st) != 0
+        || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.marker, default_header.marker, sizeof(header.marker)) != 0
+        || header.version != default_header.version
+        || header.base_addr == 0 || header.base_addr != get_base_addr(key)
+        || header.num_modules != array_size(regions))
+        return fail();
+    std::vector<import_index_entry> entries(header.num_modules);
+    size_t entries_size = sizeof(import_index_entry) * entries.size();
+    size_t header_size  = sizeof(import_index_header) + entries_size;
+    size_t size         = st.st_size;
+    if (size <= header_size || pread(fd, entries.data(), entries_size, sizeof(header)) != static_cast<ssize_t>(entries_size))
+        return fail();
+    for (size_t i = 0; i < entries.size(); i++) {
+        compacted_region const * region = get_region(regions, i);
+        olean_header const * mod_header = get_mapped_olean_header(region);
+        if (!mod_header
+            || entries[i].base_addr != reinterpret_cast<size_t>(region->base_addr())
+            || entries[i].data_hash != mod_header->data_hash)
+            return fail();
+    }
+    // the payload contains absolute pointers into the module regions and thus cannot be relocated
+    char * base_addr = reinterpret_cast<char *>(header.base_addr);
+#ifdef MAP_FIXED_NOREPLACE
+    int flags = MAP_PRIVATE | MAP_FIXED_NOREPLACE;
+#else
+    int flags = MAP_PRIVATE;
+#endif
+    void * buffer = mmap(base_addr, size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (buffer == MAP_FAILED)
+        return nullptr;
+    if (buffer != base_addr) {
+        munmap(buffer, size);
+        return nullptr;
+    }
+    advise_huge_pages(buffer, size);
+    char * data = base_addr + header_size;
+    return new compacted_region(size - header_size, data, data, [=]() { munmap(buffer, size); });
+}
+#endif
+
+/* readImportIndex (fname : @& FilePath) (key : UInt64) (regions : @& Array CompactedRegion) : IO (Option (ImportIndex × CompactedRegion)) */
+extern "C" object * lean_read_import_index(b_obj_arg fname, uint64 key, b_obj_arg regions, object *) {
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+    if (compacted_region * region = mmap_import_index(string_cstr(fname), key, regions)) {
+        return io_result_mk_ok(mk_option_some(mk_module_region(region)));
+    }
+#else
+    (void)fname; (void)key; (void)regions;
+#endif
+    return io_result_mk_ok(mk_option_none());
 }
 
 /*
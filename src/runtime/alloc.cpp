@@ -5,6 +5,17 @@ Released under Apache 2.0 license as described in the file LICENSE.
 Author: Leonardo de Moura
 */
 #include <vector>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#if defined(LEAN_WINDOWS)
+#include <windows.h>
+#elif !defined(LEAN_EMSCRIPTEN)
+#include <sys/mman.h>
+#endif
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
 #include <lean/thread.h>
 #include <lean/debug.h>
 #include <lean/alloc.h>
@@ -14,35 +25,62 @@ Author: Leonardo de Moura
 #define LEAN_SEGMENT_SIZE          8*1024*1024 // 8 Mb
 #define LEAN_NUM_SLOTS             (LEAN_MAX_SMALL_OBJECT_SIZE / LEAN_OBJECT_SIZE_DELTA)
 #define LEAN_MAX_TO_EXPORT_OBJS    1024
+#define LEAN_SEGMENT_MAX_PAGES     (LEAN_SEGMENT_SIZE / LEAN_PAGE_SIZE)
+#define LEAN_HUGE_PAGE_SIZE        (2*1024*1024) // 2 Mb
+/* Number of pages that must have become free since the last trim before a heap is trimmed automatically. */
+#define LEAN_TRIM_THRESHOLD        4096        // 32 Mb
 
 LEAN_CASSERT(LEAN_PAGE_SIZE > LEAN_MAX_SMALL_OBJECT_SIZE);
 LEAN_CASSERT(LEAN_SEGMENT_SIZE > LEAN_PAGE_SIZE);
 
 namespace lean {
 namespace allocator {
-#ifdef LEAN_RUNTIME_STATS
-static atomic<uint64> g_num_alloc(0);
-static atomic<uint64> g_num_small_alloc(0);
-static atomic<uint64> g_num_dealloc(0);
-static atomic<uint64> g_num_small_dealloc(0);
-static atomic<uint64> g_num_segments(0);
-static atomic<uint64> g_num_pages(0);
-static atomic<uint64> g_num_exports(0);
-static atomic<uint64> g_num_recycled_pages(0);
-struct alloc_stats {
-    ~alloc_stats() {
-        std::cerr << "num. alloc.:         " << g_num_alloc << "\n";
-        std::cerr << "num. small alloc.:   " << g_num_small_alloc << "\n";
-        std::cerr << "num. dealloc.:       " << g_num_dealloc << "\n";
-        std::cerr << "num. small dealloc.: " << g_num_small_dealloc << "\n";
-        std::cerr << "num. segments:       " << g_num_segments << "\n";
-        std::cerr << "num. pages:          " << g_num_pages << "\n";
-        std::cerr << "num. recycled pages: " << g_num_recycled_pages << "\n";
-        std::cerr << "num. exports:        " << g_num_exports << "\n";
+/* Counter that is only modified by the thread owning the heap it belongs to, but may be read by any thread. */
+class heap_counter {
+    atomic<uint64_t> m_value{0};
+public:
+    void operator+=(uint64_t d) { m_value.store(m_value.load(memory_order_relaxed) + d, memory_order_relaxed); }
+    void operator-=(uint64_t d) { m_value.store(m_value.load(memory_order_relaxed) - d, memory_order_relaxed); }
+    void operator++(int) { *this += 1; }
+    void operator--(int) { *this -= 1; }
+    uint64_t get() const { return m_value.load(memory_order_relaxed); }
+};
+
+/* Statistics of a heap, see `get_alloc_stats`. */
+struct heap_stats {
+    heap_counter m_num_small_alloc[LEAN_NUM_SLOTS];
+    heap_counter m_num_small_dealloc[LEAN_NUM_SLOTS];
+    heap_counter m_num_big_alloc;
+    heap_counter m_num_big_dealloc;
+    heap_counter m_big_alloc_bytes;
+    heap_counter m_big_dealloc_bytes;
+    /* The following two counters are the number of pages and segments currently owned by the heap. */
+    heap_counter m_num_pages;
+    heap_counter m_num_segments;
+    heap_counter m_num_recycled_pages;
+    heap_counter m_num_decommitted_pages;
+    heap_counter m_num_released_segments;
+    heap_counter m_num_exported_objs;
+    heap_counter m_num_imported_objs;
+
+    void add_to(alloc_stats & r) const {
+        for (unsigned i = 0; i < LEAN_NUM_SLOTS; i++) {
+            r.m_num_small_alloc[i]   += m_num_small_alloc[i].get();
+            r.m_num_small_dealloc[i] += m_num_small_dealloc[i].get();
+        }
+        r.m_num_big_alloc         += m_num_big_alloc.get();
+        r.m_num_big_dealloc       += m_num_big_dealloc.get();
+        r.m_big_alloc_bytes       += m_big_alloc_bytes.get();
+        r.m_big_dealloc_bytes     += m_big_dealloc_bytes.get();
+        r.m_num_pages             += m_num_pages.get();
+        r.m_num_segments          += m_num_segments.get();
+        r.m_num_recycled_pages    += m_num_recycled_pages.get();
+        r.m_num_decommitted_pages += m_num_decommitted_pages.get();
+        r.m_num_released_segments += m_num_released_segments.get();
+        r.m_num_exported_objs     += m_num_exported_objs.get();
+        r.m_num_imported_objs     += m_num_imported_objs.get();
     }
 };
-static alloc_stats g_alloc_stats;
-#endif
 
 struct heap;
 struct page;
@@ -56,6 +94,8 @@ struct page_header {
     unsigned         m_num_free;
     unsigned         m_slot_idx;
     bool             m_in_page_free_list;
+    /* The page did not contain any objects at the last automatic trim, and has not been reused since then. */
+    bool             m_trim_candidate;
 };
 
 struct page {
@@ -68,6 +108,7 @@ struct page {
     void set_heap(heap * h) { m_header.m_heap = h; }
     heap * get_heap() { return m_header.m_heap; }
     bool has_many_free() const { return m_header.m_num_free > m_header.m_max_free / 4; }
+    bool is_free() const { return m_header.m_num_free == m_header.m_max_free; }
     bool in_page_free_list() const { return m_header.m_in_page_free_list; }
     unsigned get_slot_idx() const { return m_header.m_slot_idx; }
     void push_free_obj(void * o);
@@ -77,10 +118,45 @@ inline char * align_ptr(char * p, size_t a) {
     return reinterpret_cast<char*>(lean_align(reinterpret_cast<size_t>(p), a));
 }
 
-struct segment {
+/* Backing of segments, set by `initialize_alloc` using the environment variable `LEAN_HUGE_PAGES`. Explicit huge
+   pages must be reserved by the administrator; we fall back to transparent ones when none are left. */
+enum class huge_pages_mode { none, transparent, explicit_ };
+static huge_pages_mode g_huge_pages = huge_pages_mode::none;
+
+/* Return the memory of the given pages to the operating system. Their contents are lost. */
+static void decommit(void * mem, size_t sz) {
+    if (g_huge_pages != huge_pages_mode::none) {
+        /* Only release whole huge pages, decommitting a part of a huge page would split it. */
+        char * begin = align_ptr(static_cast<char*>(mem), LEAN_HUGE_PAGE_SIZE);
+        char * end   = reinterpret_cast<char*>(((reinterpret_cast<size_t>(mem) + sz) / LEAN_HUGE_PAGE_SIZE) * LEAN_HUGE_PAGE_SIZE);
+        if (begin >= end)
+            return;
+        mem = begin;
+        sz  = end - begin;
+    }
+#if defined(LEAN_WINDOWS)
+    VirtualAlloc(mem, sz, MEM_RESET, PAGE_READWRITE);
+#elif defined(LEAN_EMSCRIPTEN)
+    (void)mem; (void)sz;
+#else
+    madvise(mem, sz, MADV_DONTNEED);
+#endif
+}
+
+struct segment;
+struct segment_header {
     segment *    m_next{nullptr};
     char *       m_next_page_mem;
-    char         m_data[LEAN_SEGMENT_SIZE];
+    /* Pages that do not contain any objects and have been decommitted, see `heap::trim`. Their headers are
+       not valid anymore. */
+    uint64_t     m_empty_pages[LEAN_SEGMENT_MAX_PAGES / 64]{};
+    unsigned     m_num_empty_pages{0};
+};
+
+/* The header is part of the `LEAN_SEGMENT_SIZE` bytes so that segments backed by huge pages do not need an additional
+   huge page for it, see `segment::operator new`. Thus, the first page of the segment is lost to the header. */
+struct segment : public segment_header {
+    char         m_data[LEAN_SEGMENT_SIZE - sizeof(segment_header)];
 
     char * get_first_page_mem() {
         lean_assert(align_ptr(m_data, LEAN_PAGE_SIZE) >= m_data);
@@ -93,12 +169,69 @@ struct segment {
     }
 
     bool is_full() const {
-        return m_next_page_mem + LEAN_PAGE_SIZE > m_data + LEAN_SEGMENT_SIZE;
+        return m_next_page_mem + LEAN_PAGE_SIZE > m_data + sizeof(m_data);
     }
 
-    void move_to_heap(heap *);
+    /* Number of pages allocated in this segment so far. */
+    unsigned num_pages() { return (m_next_page_mem - get_first_page_mem()) / LEAN_PAGE_SIZE; }
+    page * get_page(unsigned i) { return reinterpret_cast<page*>(get_first_page_mem() + i * LEAN_PAGE_SIZE); }
+    bool is_empty_page(unsigned i) const { return (m_empty_pages[i / 64] >> (i % 64)) & 1; }
+    void set_empty_page(unsigned i) { m_empty_pages[i / 64] |= static_cast<uint64_t>(1) << (i % 64); m_num_empty_pages++; }
+    page * pop_empty_page();
+
+    void move_to_heap(heap * from, heap * to);
+
+    static void * operator new(size_t sz);
+    static void operator delete(void * mem, size_t sz);
 };
 
+static_assert(sizeof(segment) == LEAN_SEGMENT_SIZE, "unexpected segment size");
+static_assert(LEAN_SEGMENT_SIZE % LEAN_HUGE_PAGE_SIZE == 0, "segments must consist of whole huge pages");
+
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+static size_t huge_segment_size(size_t sz) {
+    return lean_align(sz, LEAN_HUGE_PAGE_SIZE);
+}
+#endif
+
+void * segment::operator new(size_t sz) {
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+    if (g_huge_pages != huge_pages_mode::none) {
+        size_t huge_sz = huge_segment_size(sz);
+#ifdef MAP_HUGETLB
+        if (g_huge_pages == huge_pages_mode::explicit_) {
+            void * mem = mmap(nullptr, huge_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (mem != MAP_FAILED)
+                return mem;
+            /* no reserved huge pages are left, fall back to transparent ones */
+        }
+#endif
+        /* Transparent huge pages must be aligned, so we map an extra huge page and unmap the excess. */
+        void * mem = mmap(nullptr, huge_sz + LEAN_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            lean_internal_panic_out_of_memory();
+        char * begin   = static_cast<char*>(mem);
+        char * aligned = align_ptr(begin, LEAN_HUGE_PAGE_SIZE);
+        if (aligned != begin)
+            munmap(begin, aligned - begin);
+        munmap(aligned + huge_sz, begin + LEAN_HUGE_PAGE_SIZE - aligned);
+        advise_huge_pages(aligned, huge_sz);
+        return aligned;
+    }
+#endif
+    return ::operator new(sz);
+}
+
+void segment::operator delete(void * mem, size_t sz) {
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+    if (g_huge_pages != huge_pages_mode::none) {
+        munmap(mem, huge_segment_size(sz));
+        return;
+    }
+#endif
+    ::operator delete(mem);
+}
+
 struct heap {
     segment * m_curr_segment{nullptr};
     heap *    m_next_orphan{nullptr};
@@ -107,41 +240,108 @@ struct heap {
     /* Objects that must be sent to other heaps. */
     void *    m_to_export_list{nullptr};
     unsigned  m_to_export_list_size{0};
-    mutex     m_mutex; /* for the following fields */
     /* The following list contains object by this heap that were deallocated
-       by other heaps. */
-    void *    m_to_import_list{nullptr};
+       by other heaps. Other heaps push to it using compare and swap, and the owner takes the whole list at once. */
+    atomic<void *> m_to_import_list{nullptr};
     uint64_t  m_heartbeat{0}; /* Counter for implementing "deterministic timeouts". It is currently the number of small allocations */
+    /* Number of empty pages in the segments of this heap, see `segment::m_empty_pages`. */
+    unsigned  m_num_empty_pages{0};
+    /* Number of pages that have become free since the last `trim`. Some of them may have been reused since then. */
+    unsigned  m_num_freed_pages{0};
+    heap_stats m_stats;
+    /* All heaps, including orphans, are linked using the following fields, see `g_heaps`. */
+    heap *    m_prev_heap{nullptr};
+    heap *    m_next_heap{nullptr};
+    heap();
+    ~heap();
+    void push_to_import(void * head, void * tail);
     void import_objs();
     void export_objs();
     void alloc_segment();
+    page * pop_empty_page();
+    void trim(bool orphan = false, bool idle_only = false);
+    void maybe_trim() {
+        if (LEAN_UNLIKELY(m_num_freed_pages >= LEAN_TRIM_THRESHOLD))
+            trim(false, true);
+    }
 };
 
 struct heap_manager {
-    /* The mutex protects the list of orphan segments. */
-    mutex             m_mutex;
-    heap *            m_orphans{nullptr};
+    /* Lock-free stack of orphan heaps. */
+    atomic<heap *>    m_orphans{nullptr};
+
+    /* Push the orphans `head`, ..., `tail` linked using `m_next_orphan`. */
+    void push_orphans(heap * head, heap * tail) {
+        heap * old_head = m_orphans.load(memory_order_relaxed);
+        do {
+            tail->m_next_orphan = old_head;
+        } while (!m_orphans.compare_exchange_weak(old_head, head, memory_order_release, memory_order_relaxed));
+    }
 
     void push_orphan(heap * h) {
-        /* TODO(Leo): avoid mutex */
-        lock_guard<mutex> lock(m_mutex);
-        h->m_next_orphan = m_orphans;
-        m_orphans = h;
+        push_orphans(h, h);
+    }
+
+    heap * pop_all_orphans() {
+        return m_orphans.exchange(nullptr, memory_order_acquire);
     }
 
     heap * pop_orphan() {
-        /* TODO(Leo): avoid mutex */
-        lock_guard<mutex> lock(m_mutex);
-        if (m_orphans) {
-            heap * h = m_orphans;
-            m_orphans = h->m_next_orphan;
-            return h;
-        } else {
+        /* A classic Treiber stack pop, i.e., a compare and swap of the head with its successor, is subject to the
+           ABA problem since orphans are popped by multiple threads and may be pushed again. Instead, we take the
+           whole list, and push back all but its first element. Thus, a concurrent `pop_orphan` may miss the orphans
+           while we hold them, in which case it just allocates a fresh segment. */
+        heap * h = m_orphans.exchange(nullptr, memory_order_acquire);
+        if (h == nullptr)
             return nullptr;
+        if (heap * rest = h->m_next_orphan) {
+            heap * tail = rest;
+            while (tail->m_next_orphan)
+                tail = tail->m_next_orphan;
+            push_orphans(rest, tail);
         }
+        return h;
     }
 };
 
+/* All heaps, and the statistics of the heaps that have been deleted. */
+static mutex *       g_heaps_mutex   = nullptr;
+static heap *        g_heaps         = nullptr;
+static alloc_stats * g_retired_stats = nullptr;
+
+static alloc_stats mk_alloc_stats() {
+    alloc_stats r;
+    r.m_num_small_alloc.resize(LEAN_NUM_SLOTS, 0);
+    r.m_num_small_dealloc.resize(LEAN_NUM_SLOTS, 0);
+    return r;
+}
+
+heap::heap() {
+    lock_guard<mutex> lock(*g_heaps_mutex);
+    m_next_heap = g_heaps;
+    if (g_heaps)
+        g_heaps->m_prev_heap = this;
+    g_heaps = this;
+}
+
+heap::~heap() {
+    lock_guard<mutex> lock(*g_heaps_mutex);
+    m_stats.add_to(*g_retired_stats);
+    if (m_prev_heap)
+        m_prev_heap->m_next_heap = m_next_heap;
+    else
+        g_heaps = m_next_heap;
+    if (m_next_heap)
+        m_next_heap->m_prev_heap = m_prev_heap;
+}
+
+/* Set by the signal handler installed by `initialize_alloc`, and checked in `display_requested_alloc_stats`. */
+static atomic<bool> g_alloc_stats_requested(false);
+
+static void request_alloc_stats(int) {
+    g_alloc_stats_requested.store(true, memory_order_relaxed);
+}
+
 static inline page * get_page_of(void * o) {
     return reinterpret_cast<page*>((reinterpret_cast<size_t>(o)/LEAN_PAGE_SIZE)*LEAN_PAGE_SIZE);
 }
@@ -162,29 +362,31 @@ static inline void page_list_insert(page * & head, page * new_head) {
     if (head)
         head->set_prev(new_head);
     new_head->set_next(head);
+    new_head->set_prev(nullptr);
     head = new_head;
 }
 
 static inline void page_list_remove(page * & head, page * to_remove) {
+    page * prev = to_remove->get_prev();
+    page * next = to_remove->get_next();
     if (head == to_remove) {
         /* First element */
-        head = to_remove->get_next();
-    }
-    page * prev = to_remove->get_prev();
-    lean_assert(prev);
-    if (page * next = to_remove->get_next()) {
-        prev->set_next(next);
-        next->set_prev(prev);
+        lean_assert(!prev);
+        head = next;
     } else {
-        /* Last element */
-        prev->set_next(nullptr);
+        lean_assert(prev);
+        prev->set_next(next);
     }
+    if (next)
+        next->set_prev(prev);
 }
 
 static inline page * page_list_pop(page * & head) {
     lean_assert(head);
     page * r = head;
     head = head->get_next();
+    if (head)
+        head->set_prev(nullptr);
     return r;
 }
 
@@ -193,11 +395,13 @@ void page::push_free_obj(void * o) {
     set_next_obj(o, m_header.m_free_list);
     m_header.m_free_list = o;
     m_header.m_num_free++;
+    if (LEAN_UNLIKELY(is_free()))
+        get_heap()->m_num_freed_pages++;
     if (!in_page_free_list() && has_many_free()) {
         heap * h = get_heap();
         unsigned slot_idx = m_header.m_slot_idx;
         if (this != h->m_curr_page[slot_idx]) {
-            LEAN_RUNTIME_STAT_CODE(g_num_recycled_pages++);
+            h->m_stats.m_num_recycled_pages++;
             m_header.m_in_page_free_list = true;
             page_list_remove(h->m_curr_page[slot_idx], this);
             page_list_insert(h->m_page_free_list[slot_idx], this);
@@ -205,33 +409,128 @@ void page::push_free_obj(void * o) {
     }
 }
 
-void segment::move_to_heap(heap * h) {
-    /* "Move" pages in `s` to this heap */
-    page * it  = reinterpret_cast<page*>(get_first_page_mem());
-    page * end = reinterpret_cast<page*>(m_next_page_mem);
-    for (; it != end; ++it) {
-        page & p    = *it;
-        p.set_heap(h);
+void segment::move_to_heap(heap * from, heap * to) {
+    /* "Move" pages in `s` from `from` to `to`. We must unlink them from the page lists of `from`, which may
+       still own other segments whose pages are linked with the ones of this segment. */
+    unsigned n = num_pages();
+    for (unsigned i = 0; i < n; i++) {
+        if (is_empty_page(i))
+            continue;
+        page & p    = *get_page(i);
+        p.set_heap(to);
         unsigned slot_idx = p.get_slot_idx();
         if (p.in_page_free_list()) {
-            page_list_insert(h->m_page_free_list[slot_idx], &p);
+            page_list_remove(from->m_page_free_list[slot_idx], &p);
+            page_list_insert(to->m_page_free_list[slot_idx], &p);
         } else {
-            page_list_insert(h->m_curr_page[slot_idx], &p);
+            page_list_remove(from->m_curr_page[slot_idx], &p);
+            page_list_insert(to->m_curr_page[slot_idx], &p);
         }
     }
+    from->m_num_empty_pages -= m_num_empty_pages;
+    to->m_num_empty_pages   += m_num_empty_pages;
+    from->m_stats.m_num_pages -= n - m_num_empty_pages;
+    to->m_stats.m_num_pages   += n - m_num_empty_pages;
+    from->m_stats.m_num_segments--;
+    to->m_stats.m_num_segments++;
 }
 
-void heap::import_objs() {
-    void * to_import = nullptr;
-    {   // TODO(Leo): avoid mutex using compare and swap
-        lock_guard<mutex> lock(m_mutex);
-        to_import = m_to_import_list;
-        m_to_import_list = nullptr;
+page * segment::pop_empty_page() {
+    lean_assert(m_num_empty_pages > 0);
+    for (unsigned w = 0; w < LEAN_SEGMENT_MAX_PAGES / 64; w++) {
+        if (m_empty_pages[w] != 0) {
+            unsigned i = w * 64 + __builtin_ctzll(m_empty_pages[w]);
+            m_empty_pages[w] &= m_empty_pages[w] - 1;
+            m_num_empty_pages--;
+            return get_page(i);
+        }
     }
+    lean_unreachable();
+}
+
+page * heap::pop_empty_page() {
+    lean_assert(m_num_empty_pages > 0);
+    segment * s = m_curr_segment;
+    while (s->m_num_empty_pages == 0)
+        s = s->m_next;
+    m_num_empty_pages--;
+    return s->pop_empty_page();
+}
+
+/*
+  Decommit the pages of this heap that do not contain any objects, and release segments that only contain such
+  pages. Unless the heap is an orphan, the first page of each size class is kept, since `lean_alloc_small` assumes
+  it exists, and so is the current segment, since `alloc_page` assumes it contains at least one page that has not
+  been allocated yet. Thus, `m_curr_segment` is `nullptr` after trimming an orphan heap without objects.
+
+  If `idle_only` is true, a page is only decommitted if it has not been reused since the previous such trim, so that
+  pages that are repeatedly emptied and refilled are not returned to the operating system over and over again. */
+void heap::trim(bool orphan, bool idle_only) {
+    import_objs();
+    segment ** it = &m_curr_segment;
+    while (segment * s = *it) {
+        unsigned n = s->num_pages();
+        /* decommit consecutive empty pages at once */
+        char * run_begin = nullptr;
+        char * run_end   = nullptr;
+        for (unsigned i = 0; i < n; i++) {
+            if (s->is_empty_page(i))
+                continue;
+            page * p = s->get_page(i);
+            unsigned slot_idx = p->get_slot_idx();
+            if (!p->is_free() || (!orphan && p == m_curr_page[slot_idx]))
+                continue;
+            if (idle_only && !p->m_header.m_trim_candidate) {
+                p->m_header.m_trim_candidate = true;
+                continue;
+            }
+            if (p->in_page_free_list())
+                page_list_remove(m_page_free_list[slot_idx], p);
+            else
+                page_list_remove(m_curr_page[slot_idx], p);
+            s->set_empty_page(i);
+            m_num_empty_pages++;
+            m_stats.m_num_pages--;
+            m_stats.m_num_decommitted_pages++;
+            char * mem = reinterpret_cast<char*>(p);
+            if (mem != run_end) {
+                if (run_begin)
+                    decommit(run_begin, run_end - run_begin);
+                run_begin = mem;
+            }
+            run_end = mem + LEAN_PAGE_SIZE;
+        }
+        if (run_begin)
+            decommit(run_begin, run_end - run_begin);
+        if ((orphan || s != m_curr_segment) && s->m_num_empty_pages == n) {
+            m_stats.m_num_segments--;
+            m_stats.m_num_released_segments++;
+            *it = s->m_next;
+            m_num_empty_pages -= n;
+            delete s;
+        } else {
+            it = &s->m_next;
+        }
+    }
+    m_num_freed_pages = 0;
+}
+
+void heap::push_to_import(void * head, void * tail) {
+    void * old_head = m_to_import_list.load(memory_order_relaxed);
+    do {
+        set_next_obj(tail, old_head);
+    } while (!m_to_import_list.compare_exchange_weak(old_head, head, memory_order_release, memory_order_relaxed));
+}
+
+void heap::import_objs() {
+    if (m_to_import_list.load(memory_order_relaxed) == nullptr)
+        return;
+    void * to_import = m_to_import_list.exchange(nullptr, memory_order_acquire);
     while (to_import) {
         page * p = get_page_of(to_import);
         void * n = get_next_obj(to_import);
         p->push_free_obj(to_import);
+        m_stats.m_num_imported_objs++;
         to_import = n;
     }
 }
@@ -277,12 +576,11 @@ void heap::export_objs() {
         }
         o = n;
     }
+    m_stats.m_num_exported_objs += m_to_export_list_size;
     m_to_export_list      = nullptr;
     m_to_export_list_size = 0;
     for (export_entry const & e : to_export) {
-        unique_lock<mutex> lock(e.m_heap->m_mutex);
-        set_next_obj(e.m_tail, e.m_heap->m_to_import_list);
-        e.m_heap->m_to_import_list = e.m_head;
+        e.m_heap->push_to_import(e.m_head, e.m_tail);
     }
 }
 
@@ -294,7 +592,7 @@ void heap::alloc_segment() {
             h->import_objs();
             segment * s = h->m_curr_segment;
             h->m_curr_segment = s->m_next;
-            s->move_to_heap(this);
+            s->move_to_heap(h, this);
             if (h->m_curr_segment != nullptr) {
                 g_heap_manager->push_orphan(h);
             } else {
@@ -309,7 +607,7 @@ void heap::alloc_segment() {
             /* If `s` is full, we must "keep looking" because `alloc_page` assumes that `m_curr_segment`
                contains at least one free page. */
         } else {
-            LEAN_RUNTIME_STAT_CODE(g_num_segments++);
+            m_stats.m_num_segments++;
             segment * s = new segment();
             s->m_next   = m_curr_segment;
             m_curr_segment = s;
@@ -320,13 +618,19 @@ void heap::alloc_segment() {
 
 static page * alloc_page(heap * h, unsigned obj_size) {
     lean_assert(lean_align(obj_size, LEAN_OBJECT_SIZE_DELTA) == obj_size);
-    segment * s = h->m_curr_segment;
-    LEAN_RUNTIME_STAT_CODE(g_num_pages++);
-    page * p    = new (s->m_next_page_mem) page();
-    s->m_next_page_mem += LEAN_PAGE_SIZE;
-    if (s->is_full()) {
-        /* s is full, we need to allocate a new one. */
-        h->alloc_segment();
+    h->m_stats.m_num_pages++;
+    page * p;
+    if (h->m_num_empty_pages > 0) {
+        /* reuse a page decommitted by `heap::trim` */
+        p = new (h->pop_empty_page()) page();
+    } else {
+        segment * s = h->m_curr_segment;
+        p = new (s->m_next_page_mem) page();
+        s->m_next_page_mem += LEAN_PAGE_SIZE;
+        if (s->is_full()) {
+            /* s is full, we need to allocate a new one. */
+            h->alloc_segment();
+        }
     }
     unsigned slot_idx        = lean_get_slot_idx(obj_size);
     p->m_header.m_heap       = h;
@@ -360,14 +664,17 @@ static page * alloc_page(heap * h, unsigned obj_size) {
     p->m_header.m_max_free   = num_free;
     p->m_header.m_num_free   = num_free;
     p->m_header.m_in_page_free_list = false;
+    p->m_header.m_trim_candidate    = false;
     return p;
 }
 
 static void finalize_heap(void * _h) {
     heap * h = static_cast<heap*>(_h);
     h->export_objs();
+    /* We do not trim `h` here since its initialized pages are reused by the next thread adopting it. */
     h->import_objs();
     g_heap_manager->push_orphan(h);
+    g_heap = nullptr;
 }
 
 static void init_heap(bool main) {
@@ -399,6 +706,7 @@ void init_thread_heap() {
 extern "C" void * lean_alloc_small(unsigned sz, unsigned slot_idx) {
     page * p = g_heap->m_curr_page[slot_idx];
     g_heap->m_heartbeat++;
+    g_heap->m_stats.m_num_small_alloc[slot_idx]++;
     void * r = p->m_header.m_free_list;
     if (LEAN_UNLIKELY(r == nullptr)) {
         if (g_heap->m_page_free_list[slot_idx] == nullptr) {
@@ -410,6 +718,7 @@ extern "C" void * lean_alloc_small(unsigned sz, unsigned slot_idx) {
         } else {
             p = page_list_pop(g_heap->m_page_free_list[slot_idx]);
             p->m_header.m_in_page_free_list = false;
+            p->m_header.m_trim_candidate    = false;
             page_list_insert(g_heap->m_curr_page[slot_idx], p);
         }
         r = p->m_header.m_free_list;
@@ -436,42 +745,47 @@ uint64_t get_num_heartbeats() {
 
 void * alloc(size_t sz) {
     sz = lean_align(sz, LEAN_OBJECT_SIZE_DELTA);
-    LEAN_RUNTIME_STAT_CODE(g_num_alloc++);
     if (LEAN_UNLIKELY(sz > LEAN_MAX_SMALL_OBJECT_SIZE)) {
         void * r = malloc(sz);
         if (r == nullptr) lean_internal_panic_out_of_memory();
+        if (g_heap) {
+            g_heap->m_stats.m_num_big_alloc++;
+            g_heap->m_stats.m_big_alloc_bytes += sz;
+        }
         return r;
     }
     lean_assert(g_heap);
-    LEAN_RUNTIME_STAT_CODE(g_num_small_alloc++);
     unsigned slot_idx = lean_get_slot_idx(sz);
     return lean_alloc_small(sz, slot_idx);
 }
 
 static inline void dealloc_small_core(void * o) {
-    LEAN_RUNTIME_STAT_CODE(g_num_small_dealloc++);
     if (LEAN_UNLIKELY(g_heap == nullptr)) {
         init_heap(false);
     }
     lean_assert(g_heap);
     page * p = get_page_of(o);
+    g_heap->m_stats.m_num_small_dealloc[p->get_slot_idx()]++;
     if (LEAN_LIKELY(p->get_heap() == g_heap)) {
         p->push_free_obj(o);
+        g_heap->maybe_trim();
     } else {
         set_next_obj(o, g_heap->m_to_export_list);
         g_heap->m_to_export_list = o;
         g_heap->m_to_export_list_size++;
         if (g_heap->m_to_export_list_size > LEAN_MAX_TO_EXPORT_OBJS) {
-            LEAN_RUNTIME_STAT_CODE(g_num_exports++);
             g_heap->export_objs();
         }
     }
 }
 
 void dealloc(void * o, size_t sz) {
-    LEAN_RUNTIME_STAT_CODE(g_num_dealloc++);
     sz = lean_align(sz, LEAN_OBJECT_SIZE_DELTA);
     if (LEAN_UNLIKELY(sz > LEAN_MAX_SMALL_OBJECT_SIZE)) {
+        if (g_heap) {
+            g_heap->m_stats.m_num_big_dealloc++;
+            g_heap->m_stats.m_big_dealloc_bytes += sz;
+        }
         return free(o);
     }
     dealloc_small_core(o);
@@ -486,9 +800,144 @@ extern "C" unsigned lean_small_mem_size(void * o) {
     return p->m_header.m_obj_size;
 }
 
+void trim_heap() {
+    if (g_heap) {
+        g_heap->export_objs();
+        g_heap->trim();
+    }
+    /* Trim the heaps of finished threads. We take all of them, so that they are not adopted concurrently. */
+    heap * head = nullptr;
+    heap * tail = nullptr;
+    heap * h = g_heap_manager->pop_all_orphans();
+    while (h) {
+        heap * next = h->m_next_orphan;
+        h->trim(true);
+        if (h->m_curr_segment == nullptr) {
+            /* `h` does not contain any objects anymore */
+            delete h;
+        } else {
+            h->m_next_orphan = head;
+            head = h;
+            if (!tail) tail = h;
+        }
+        h = next;
+    }
+    if (head)
+        g_heap_manager->push_orphans(head, tail);
+#if defined(__GLIBC__)
+    /* big objects are allocated using `malloc` */
+    malloc_trim(0);
+#endif
+}
+
+alloc_stats get_alloc_stats() {
+    alloc_stats r = mk_alloc_stats();
+    lock_guard<mutex> lock(*g_heaps_mutex);
+    for (heap * h = g_heaps; h; h = h->m_next_heap)
+        h->m_stats.add_to(r);
+    alloc_stats const & d = *g_retired_stats;
+    for (unsigned i = 0; i < LEAN_NUM_SLOTS; i++) {
+        r.m_num_small_alloc[i]   += d.m_num_small_alloc[i];
+        r.m_num_small_dealloc[i] += d.m_num_small_dealloc[i];
+    }
+    r.m_num_big_alloc         += d.m_num_big_alloc;
+    r.m_num_big_dealloc       += d.m_num_big_dealloc;
+    r.m_big_alloc_bytes       += d.m_big_alloc_bytes;
+    r.m_big_dealloc_bytes     += d.m_big_dealloc_bytes;
+    r.m_num_recycled_pages    += d.m_num_recycled_pages;
+    r.m_num_decommitted_pages += d.m_num_decommitted_pages;
+    r.m_num_released_segments += d.m_num_released_segments;
+    r.m_num_exported_objs     += d.m_num_exported_objs;
+    r.m_num_imported_objs     += d.m_num_imported_objs;
+    return r;
+}
+
+void display_alloc_stats(std::ostream & out) {
+    alloc_stats s = get_alloc_stats();
+    uint64_t num_small_alloc = 0, num_small_dealloc = 0, small_bytes = 0;
+    for (unsigned i = 0; i < LEAN_NUM_SLOTS; i++) {
+        num_small_alloc   += s.m_num_small_alloc[i];
+        num_small_dealloc += s.m_num_small_dealloc[i];
+        small_bytes       += (s.m_num_small_alloc[i] - s.m_num_small_dealloc[i]) * (i+1) * LEAN_OBJECT_SIZE_DELTA;
+    }
+    out << "num. small alloc.:       " << num_small_alloc << "\n";
+    out << "num. small dealloc.:     " << num_small_dealloc << "\n";
+    out << "live small objects (b):  " << small_bytes << "\n";
+    out << "num. big alloc.:         " << s.m_num_big_alloc << "\n";
+    out << "num. big dealloc.:       " << s.m_num_big_dealloc << "\n";
+    out << "live big objects (b):    " << s.m_big_alloc_bytes - s.m_big_dealloc_bytes << "\n";
+    out << "num. pages:              " << s.m_num_pages << "\n";
+    out << "num. segments:           " << s.m_num_segments << "\n";
+    out << "num. recycled pages:     " << s.m_num_recycled_pages << "\n";
+    out << "num. decommitted pages:  " << s.m_num_decommitted_pages << "\n";
+    out << "num. released segments:  " << s.m_num_released_segments << "\n";
+    out << "num. exported objects:   " << s.m_num_exported_objs << "\n";
+    out << "num. imported objects:   " << s.m_num_imported_objs << "\n";
+    out << "live objects per size class:\n";
+    for (unsigned i = 0; i < LEAN_NUM_SLOTS; i++) {
+        if (s.m_num_small_alloc[i] > 0)
+            out << "  " << (i+1) * LEAN_OBJECT_SIZE_DELTA << ": " << s.m_num_small_alloc[i] - s.m_num_small_dealloc[i]
+                << " (" << s.m_num_small_alloc[i] << " alloc.)\n";
+    }
+}
+
+void display_requested_alloc_stats() {
+    if (LEAN_UNLIKELY(g_alloc_stats_requested.load(memory_order_relaxed)) && g_alloc_stats_requested.exchange(false))
+        display_alloc_stats(std::cerr);
+}
+
+#ifdef LEAN_RUNTIME_STATS
+struct alloc_stats_reporter {
+    ~alloc_stats_reporter() {
+        if (g_heaps_mutex)
+            display_alloc_stats(std::cerr);
+    }
+};
+static alloc_stats_reporter g_alloc_stats_reporter;
+#endif
+
+void advise_huge_pages(void * mem, size_t sz) {
+#if defined(MADV_HUGEPAGE)
+    if (g_huge_pages != huge_pages_mode::none)
+        madvise(mem, sz, MADV_HUGEPAGE);
+#else
+    (void)mem; (void)sz;
+#endif
+}
+
 void initialize_alloc() {
-    g_heap_manager = new heap_manager();
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+    /* Back segments with transparent (`thp`) or explicitly reserved (`hugetlb`) huge pages. */
+    if (char const * mode = std::getenv("LEAN_HUGE_PAGES")) {
+        if (strcmp(mode, "thp") == 0)
+            g_huge_pages = huge_pages_mode::transparent;
+        else if (strcmp(mode, "hugetlb") == 0)
+            g_huge_pages = huge_pages_mode::explicit_;
+    }
+#endif
+    g_heaps_mutex   = new mutex();
+    g_retired_stats = new alloc_stats(mk_alloc_stats());
+    g_heap_manager  = new heap_manager();
     init_heap(true);
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+    /* Dump the allocator statistics to `stderr` when receiving the given signal, e.g. `10` for `SIGUSR1` on Linux,
+       see `display_requested_alloc_stats`. A handler installed by the embedding application is not replaced. */
+    if (char const * sig = std::getenv("LEAN_ALLOC_STATS_SIGNAL")) {
+        if (int signum = std::atoi(sig)) {
+            struct sigaction prev;
+            if (sigaction(signum, nullptr, &prev) == 0 && !(prev.sa_flags & SA_SIGINFO) && prev.sa_handler == SIG_DFL) {
+                struct sigaction action;
+                memset(&action, 0, sizeof(struct sigaction));
+                sigemptyset(&action.sa_mask);
+                action.sa_flags   = SA_RESTART;
+                action.sa_handler = request_alloc_stats;
+                sigaction(signum, &action, nullptr);
+            } else {
+                std::cerr << "LEAN_ALLOC_STATS_SIGNAL: signal " << signum << " is already handled, ignoring\n";
+            }
+        }
+    }
+#endif
 }
 
 void finalize_alloc() {
@@ -8,9 +8,17 @@ Author: Leonardo de Moura
 #include <algorithm>
 #include <string>
 #include <vector>
+#include <cerrno>
+#include <cstring>
 #include <lean/hash.h>
 #include <lean/lean.h>
 #include <lean/compact.h>
+#include <lean/exception.h>
+#include <lean/sstream.h>
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 
 #define LEAN_COMPACTOR_INIT_SZ 1024*1024
 #define LEAN_MAX_SHARING_TABLE_INITIAL_SIZE 1024*1024
@@ -30,7 +38,7 @@ struct max_sharing_hash {
     object_compactor * m;
     max_sharing_hash(object_compactor * manager):m(manager) {}
     unsigned operator()(max_sharing_key const & k) const {
-        return hash_str(k.m_size, reinterpret_cast<char const *>(m->m_begin) + k.m_offset, 17);
+        return hash_str(k.m_size, m->at(k.m_offset), 17);
     }
 };
 
@@ -39,7 +47,7 @@ struct max_sharing_eq {
     max_sharing_eq(object_compactor * manager):m(manager) {}
     bool operator()(max_sharing_key const & k1, max_sharing_key const & k2) const {
         if (k1.m_size != k2.m_size) return false;
-        return memcmp(reinterpret_cast<char*>(m->m_begin) + k1.m_offset, reinterpret_cast<char*>(m->m_begin) + k2.m_offset, k1.m_size) == 0;
+        return memcmp(m->at(k1.m_offset), m->at(k2.m_offset), k1.m_size) == 0;
     }
 };
 
@@ -62,15 +70,78 @@ struct terminator_object {
     lean_object * m_value;
 };
 
-object_compactor::object_compactor():
+object_compactor::object_compactor(void * base_addr):
     m_max_sharing_table(new max_sharing_table(this)),
+    m_has_import_regions(false),
+    m_local(false),
+    m_base_addr(base_addr),
     m_begin(malloc(LEAN_COMPACTOR_INIT_SZ)),
     m_end(m_begin),
-    m_capacity(static_cast<char*>(m_begin) + LEAN_COMPACTOR_INIT_SZ) {
+    m_capacity(static_cast<char*>(m_begin) + LEAN_COMPACTOR_INIT_SZ),
+    m_fd(-1),
+    m_fd_offset(0),
+    m_flushed(0),
+    m_map(nullptr),
+    m_map_size(0) {
+}
+
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+object_compactor::object_compactor(void * base_addr, int fd, size_t fd_offset):
+    object_compactor(base_addr) {
+    m_fd        = fd;
+    m_fd_offset = fd_offset;
 }
+#endif
 
 object_compactor::~object_compactor() {
     free(m_begin);
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+    if (m_map)
+        munmap(m_map, m_map_size);
+#endif
+}
+
+/* Return a pointer to the compacted data at `offset`. The result is invalidated by the next `flush`. */
+char const * object_compactor::at(size_t offset) const {
+    if (offset >= m_flushed)
+        return static_cast<char const*>(m_begin) + (offset - m_flushed);
+    lean_assert(m_fd_offset + offset < m_map_size);
+    return m_map + m_fd_offset + offset;
+}
+
+/* Write the buffer to `m_fd`, and extend the mapping of the file to cover the data written so far. */
+void object_compactor::flush() {
+#if !defined(LEAN_WINDOWS) && !defined(LEAN_EMSCRIPTEN)
+    lean_assert(m_fd != -1);
+    char const * it  = static_cast<char const*>(m_begin);
+    char const * end = static_cast<char const*>(m_end);
+    while (it < end) {
+        ssize_t n = pwrite(m_fd, it, end - it, m_fd_offset + m_flushed);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            throw exception(sstream() << "failed to write compacted data: " << strerror(errno));
+        it        += n;
+        m_flushed += n;
+    }
+    m_end = m_begin;
+    size_t file_size = m_fd_offset + m_flushed;
+    if (file_size > m_map_size) {
+        // remap with exponential growth, the data is referenced by offset only
+        size_t new_map_size = std::max(file_size, 2 * m_map_size);
+        if (m_map)
+            munmap(m_map, m_map_size);
+        /* The mapping may extend past the end of the file, but we only access the data written so far. */
+        void * map = mmap(nullptr, new_map_size, PROT_READ, MAP_SHARED, m_fd, 0);
+        if (map == MAP_FAILED) {
+            m_map      = nullptr;
+            m_map_size = 0;
+            throw exception(sstream() << "failed to map compacted data: " << strerror(errno));
+        }
+        m_map      = static_cast<char *>(map);
+        m_map_size = new_map_size;
+    }
+#endif
 }
 
 /*
@@ -84,11 +155,16 @@ void * object_compactor::alloc(size_t sz) {
     size_t rem = sz % sizeof(void*);
     if (rem != 0)
         sz = sz + sizeof(void*) - rem;
+    if (m_fd != -1 && static_cast<char*>(m_end) + sz > m_capacity && m_end != m_begin) {
+        /* Objects are written after all of their children, so the buffer never needs to be patched after
+           it has been written. */
+        flush();
+    }
     while (static_cast<char*>(m_end) + sz > m_capacity) {
         size_t new_capacity = capacity()*2;
         void * new_begin = malloc(new_capacity);
-        memcpy(new_begin, m_begin, size());
-        m_end      = static_cast<char*>(new_begin) + size();
+        memcpy(new_begin, m_begin, buffer_size());
+        m_end      = static_cast<char*>(new_begin) + buffer_size();
         m_capacity = static_cast<char*>(new_begin) + new_capacity;
         free(m_begin);
         m_begin    = new_begin;
@@ -100,26 +176,75 @@ void * object_compactor::alloc(size_t sz) {
     return r;
 }
 
+void object_compactor::save(object * o, size_t new_o_offset) {
+    m_obj_table.insert(std::make_pair(o, reinterpret_cast<object_offset>(static_cast<char*>(m_base_addr) + new_o_offset)));
+}
+
 void object_compactor::save(object * o, object * new_o) {
     lean_assert(m_begin <= new_o && new_o < m_end);
-    m_obj_table.insert(std::make_pair(o, reinterpret_cast<object_offset>(reinterpret_cast<char*>(new_o) - reinterpret_cast<char*>(m_begin))));
+    save(o, offset_of(new_o));
 }
 
-void object_compactor::save_max_sharing(object * o, object * new_o, size_t new_o_sz) {
-    max_sharing_key k(reinterpret_cast<char*>(new_o) - reinterpret_cast<char*>(m_begin), new_o_sz);
+/* Return true if `new_o` is kept, i.e., if there is no copy of it already. */
+bool object_compactor::save_max_sharing(object * o, object * new_o, size_t new_o_sz) {
+    max_sharing_key k(offset_of(new_o), new_o_sz);
     auto it = m_max_sharing_table->m_table.find(k);
     if (it != m_max_sharing_table->m_table.end()) {
         m_end = new_o;
-        new_o = reinterpret_cast<lean_object*>(reinterpret_cast<char*>(m_begin) + it->m_offset);
+        save(o, it->m_offset);
+        return false;
     } else {
         m_max_sharing_table->m_table.insert(k);
+        save(o, new_o);
+        return true;
+    }
+}
+
+void object_compactor::add_external_region(void const * begin, void const * end) {
+    lean_assert(begin <= end);
+    m_external_regions[begin] = external_region { begin, end, begin, false, {} };
+}
+
+void object_compactor::add_import_region(void const * begin, void const * end, void const * base_addr) {
+    lean_assert(begin <= end);
+    m_external_regions[begin] = external_region { begin, end, base_addr, true, {} };
+    m_has_import_regions = true;
+}
+
+std::vector<size_t> const & object_compactor::get_import_refs(void const * begin) const {
+    auto it = m_external_regions.find(begin);
+    lean_assert(it != m_external_regions.end() && it->second.m_is_import);
+    return it->second.m_refs;
+}
+
+auto object_compactor::find_external(object * o) const -> external_region const * {
+    if (m_local)
+        return nullptr;
+    auto it = m_external_regions.upper_bound(o);
+    if (it == m_external_regions.begin())
+        return nullptr;
+    --it;
+    if (o < it->second.m_end)
+        return &it->second;
+    return nullptr;
+}
+
+/* `*slot` has been set to the offset of `o`. Record its position if `o` belongs to an import region. */
+void object_compactor::record_import_ref(object * o, void const * slot) {
+    if (!m_has_import_regions || lean_is_scalar(o))
+        return;
+    if (external_region const * r = find_external(o)) {
+        if (r->m_is_import)
+            const_cast<external_region *>(r)->m_refs.push_back(offset_of(slot));
     }
-    save(o, new_o);
 }
 
 object_offset object_compactor::to_offset(object * o) {
     if (lean_is_scalar(o)) {
         return o;
+    } else if (external_region const * r = find_external(o)) {
+        return reinterpret_cast<object_offset>(reinterpret_cast<size_t>(r->m_base_addr) +
+                                               (reinterpret_cast<size_t>(o) - reinterpret_cast<size_t>(r->m_begin)));
     } else {
         auto it = m_obj_table.find(o);
         if (it == m_obj_table.end()) {
@@ -136,6 +261,7 @@ void object_compactor::insert_terminator(object * o) {
     terminator_object * t = (terminator_object*) alloc(sz);
     lean_set_non_heap_header((lean_object*)t, sz, LeanReserved, 0);
     t->m_value = to_offset(o);
+    record_import_ref(o, &t->m_value);
 }
 
 object * object_compactor::copy_object(object * o) {
@@ -203,7 +329,10 @@ bool object_compactor::insert_constructor(object * o) {
     object * new_o = copy_object(o);
     for (unsigned i = 0; i < lean_ctor_num_objs(o); i++)
         lean_ctor_set(new_o, i, offsets[i]);
-    save_max_sharing(o, new_o, lean_object_byte_size(o));
+    if (save_max_sharing(o, new_o, lean_object_byte_size(o))) {
+        for (unsigned i = 0; i < num_objs; i++)
+            record_import_ref(cnstr_get(o, i), lean_ctor_obj_cptr(new_o) + i);
+    }
     return true;
 }
 
@@ -229,7 +358,10 @@ bool object_compactor::insert_array(object * o) {
     for (size_t i = 0; i < sz; i++) {
         lean_array_set_core((lean_object*)new_o, i, offsets[i]);
     }
-    save_max_sharing(o, (lean_object*)new_o, obj_sz);
+    if (save_max_sharing(o, (lean_object*)new_o, obj_sz)) {
+        for (size_t i = 0; i < sz; i++)
+            record_import_ref(array_get(o, i), new_o->m_data + i);
+    }
     return true;
 }
 
@@ -240,7 +372,8 @@ bool object_compactor::insert_thunk(object * o) {
         return false;
     object * r = copy_object(o);
     lean_to_thunk(r)->m_value = c;
-    save_max_sharing(o, r, lean_object_byte_size(o));
+    if (save_max_sharing(o, r, lean_object_byte_size(o)))
+        record_import_ref(v, &lean_to_thunk(r)->m_value);
     return true;
 }
 
@@ -251,7 +384,8 @@ bool object_compactor::insert_ref(object * o) {
         return false;
     object * r = copy_object(o);
     lean_to_ref(r)->m_value = c;
-    save_max_sharing(o, r, lean_object_byte_size(o));
+    if (save_max_sharing(o, r, lean_object_byte_size(o)))
+        record_import_ref(v, &lean_to_ref(r)->m_value);
     return true;
 }
 
@@ -263,22 +397,28 @@ bool object_compactor::insert_task(object * o) {
     object * r = copy_object(o);
     lean_assert(lean_to_task(r)->m_imp == nullptr);
     lean_to_task(r)->m_value = c;
-    save_max_sharing(o, r, lean_object_byte_size(o));
+    if (save_max_sharing(o, r, lean_object_byte_size(o)))
+        record_import_ref(v, &lean_to_task(r)->m_value);
     return true;
 }
 
 void object_compactor::insert_mpz(object * o) {
-    std::string s       = mpz_value(o).to_string();
-    /* Remark: in the compacted_region object, we use the space after the mpz_object
-       to store the next mpz_object in the region AFTER we convert the string back
-       into an mpz number. So, we use std::max to make sure we have enough space for both. */
-    size_t extra_space  = std::max(s.size() + 1, sizeof(mpz_object*));
-    size_t sz      = sizeof(mpz_object) + extra_space;
-    object * new_o = (lean_object*)alloc(sz);
+    /* We store the limbs right after the `mpz_object`, and make `_mp_d` point to them.
+       Thus, the `mpz` value can be used in place after loading the region without
+       allocating memory using GMP. Compacted `mpz` values are never modified nor freed by GMP. */
+    __mpz_struct const & v = to_mpz(o)->m_value.m_val[0];
+    size_t nlimbs  = mpz_size(&v);
+    size_t data_sz = sizeof(mp_limb_t) * nlimbs;
+    size_t sz      = sizeof(mpz_object) + data_sz;
+    mpz_object * new_o = (mpz_object *)alloc(sz);
     lean_set_non_heap_header((lean_object*)new_o, sz, LeanMPZ, 0);
+    char * data = reinterpret_cast<char*>(new_o) + sizeof(mpz_object);
+    memcpy(data, v._mp_d, data_sz);
+    __mpz_struct & new_v = new_o->m_value.m_val[0];
+    new_v._mp_alloc = nlimbs;
+    new_v._mp_size  = v._mp_size;
+    new_v._mp_d     = reinterpret_cast<mp_limb_t *>(static_cast<char*>(m_base_addr) + offset_of(data));
     save(o, (lean_object*)new_o);
-    void * data    = reinterpret_cast<char*>(new_o) + sizeof(mpz_object);
-    memcpy(data, s.c_str(), s.size() + 1);
 }
 
 #ifdef LEAN_TAG_COUNTERS
@@ -318,9 +458,9 @@ tag_counter_manager g_tag_counter_manager;
 
 #endif
 
-void object_compactor::operator()(object * o) {
+void object_compactor::copy(object * o) {
     lean_assert(m_todo.empty());
-    if (!lean_is_scalar(o)) {
+    if (!lean_is_scalar(o) && !find_external(o)) {
         m_todo.push_back(o);
         while (!m_todo.empty()) {
             object * curr = m_todo.back();
@@ -350,21 +490,41 @@ void object_compactor::operator()(object * o) {
         }
         m_tmp.clear();
     }
+}
+
+void object_compactor::copy_local(object * o) {
+    m_local = true;
+    copy(o);
+    m_local = false;
+}
+
+void object_compactor::operator()(object * o) {
+    copy(o);
     insert_terminator(o);
+    if (m_fd != -1)
+        flush();
 }
 
-compacted_region::compacted_region(size_t sz, void * data):
+compacted_region::compacted_region(size_t sz, void * data, void * base_addr, std::function<void()> const & free_data,
+                                   compacted_region_format format):
+    m_base_addr(base_addr),
     m_begin(data),
     m_next(data),
     m_end(static_cast<char*>(data)+sz),
-    m_nested_mpzs(nullptr) {
+    m_format(format),
+    m_has_imports(false),
+    m_relocated_on_access(false),
+    m_nested_mpzs(nullptr),
+    m_free_data(free_data) {
+    lean_assert(format != compacted_region_format::v0 || base_addr == nullptr);
+}
+
+compacted_region::compacted_region(size_t sz, void * data):
+    compacted_region(sz, data, nullptr, [=]() { free(data); }) {
 }
 
 compacted_region::compacted_region(object_compactor const & c):
-    m_begin(malloc(c.size())),
-    m_next(m_begin),
-    m_end(static_cast<char*>(m_begin) + c.size()),
-    m_nested_mpzs(nullptr) {
+    compacted_region(c.size(), malloc(c.size()), c.base_addr(), [=]() { free(m_begin); }) {
     memcpy(m_begin, c.data(), c.size());
 }
 
@@ -373,12 +533,15 @@ compacted_region::~compacted_region() {
         m_nested_mpzs->m_value.~mpz();
         m_nested_mpzs = *reinterpret_cast<mpz_object**>(reinterpret_cast<char*>(m_nested_mpzs) + sizeof(mpz_object));
     }
-    free(m_begin);
+    m_free_data();
 }
 
 inline object * compacted_region::fix_object_ptr(object * o) {
     if (lean_is_scalar(o)) return o;
-    return reinterpret_cast<object*>(static_cast<char*>(m_begin) + reinterpret_cast<size_t>(o));
+    // references to import regions are relocated by the owner of the region, if necessary
+    if (m_has_imports && static_cast<size_t>(reinterpret_cast<char*>(o) - static_cast<char*>(m_base_addr)) >= size())
+        return o;
+    return reinterpret_cast<object*>(static_cast<char*>(m_begin) + (reinterpret_cast<char*>(o) - static_cast<char*>(m_base_addr)));
 }
 
 inline void compacted_region::move(size_t d) {
@@ -428,7 +591,15 @@ inline void compacted_region::fix_task(object * o) {
     move(sizeof(lean_task_object));
 }
 
-void compacted_region::fix_mpz(object * o) {
+inline void compacted_region::fix_mpz(object * o) {
+    if (m_format == compacted_region_format::v0)
+        return fix_mpz_v0(o);
+    __mpz_struct & v = to_mpz(o)->m_value.m_val[0];
+    v._mp_d = reinterpret_cast<mp_limb_t *>(static_cast<char*>(m_begin) + (reinterpret_cast<char*>(v._mp_d) - static_cast<char*>(m_base_addr)));
+    move(o);
+}
+
+void compacted_region::fix_mpz_v0(object * o) {
     move(sizeof(mpz_object));
     /* convert string after mpz_object into a mpz value */
     std::string s;
@@ -451,9 +622,79 @@ void compacted_region::fix_mpz(object * o) {
     move(sz);
 }
 
+size_t compacted_region::object_byte_size(object * o) {
+    size_t sz;
+    uint8 tag = lean_ptr_tag(o);
+    switch (tag) {
+    case LeanScalarArray: sz = lean_sarray_byte_size(o); break;
+    case LeanString:      sz = lean_string_byte_size(o); break;
+    case LeanThunk:       sz = sizeof(lean_thunk_object); break;
+    case LeanRef:         sz = sizeof(lean_ref_object); break;
+    case LeanTask:        sz = sizeof(lean_task_object); break;
+    case LeanReserved:    sz = sizeof(terminator_object); break;
+    default:              sz = lean_object_byte_size(o); break;
+    }
+    // see `move`
+    return (sz + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+}
+
+void compacted_region::relocate_block(char const * src, char * dst, size_t first_obj, size_t begin, size_t end) {
+    lean_assert(m_format == compacted_region_format::v1);
+    if (dst != src)
+        memcpy(dst + begin, src + begin, end - begin);
+    auto fix_slots = [&](size_t first, size_t num) {
+        // only the slots in `[begin, end)`
+        size_t i   = first < begin ? (begin - first) / sizeof(object*) : 0;
+        size_t max = first < end ? (end - first + sizeof(object*) - 1) / sizeof(object*) : 0;
+        for (; i < std::min(num, max); i++) {
+            size_t slot = first + i * sizeof(object*);
+            object * o;
+            memcpy(&o, src + slot, sizeof(object*));
+            o = fix_object_ptr(o);
+            memcpy(dst + slot, &o, sizeof(object*));
+        }
+    };
+    size_t off = first_obj;
+    while (off < end) {
+        object * curr = reinterpret_cast<object*>(const_cast<char*>(src) + off);
+        uint8 tag = lean_ptr_tag(curr);
+        if (tag <= LeanMaxCtorTag) {
+            fix_slots(off + sizeof(lean_object), lean_ctor_num_objs(curr));
+        } else {
+            switch (tag) {
+            case LeanArray:       fix_slots(off + offsetof(lean_array_object, m_data), lean_array_size(curr)); break;
+            case LeanMPZ: {
+                // the limbs are stored in the region, see `object_compactor::insert_mpz`
+                char * limbs_slot = reinterpret_cast<char*>(&to_mpz(curr)->m_value.m_val[0]._mp_d);
+                fix_slots(off + (limbs_slot - reinterpret_cast<char*>(curr)), 1);
+                break;
+            }
+            case LeanThunk:       fix_slots(off + offsetof(lean_thunk_object, m_value), 1); break;
+            case LeanRef:         fix_slots(off + offsetof(lean_ref_object, m_value), 1); break;
+            case LeanTask:        fix_slots(off + offsetof(lean_task_object, m_value), 1); break;
+            case LeanReserved:    fix_slots(off + offsetof(terminator_object, m_value), 1); break;
+            case LeanScalarArray: case LeanString: break;
+            default:              lean_unreachable();
+            }
+        }
+        off += object_byte_size(curr);
+    }
+}
+
 object * compacted_region::read() {
     if (m_next == m_end)
         return nullptr; /* all objects have been read */
+    if (is_at_base_addr() || m_relocated_on_access) {
+        /* The region is already located at the address it was compacted against, so no object needs to be
+           relocated and we do not have to touch (or even page in) any of them. Remark: this fast path
+           assumes the region was produced by a single `object_compactor::operator()` invocation, and thus its
+           root is stored in the terminator at the very end. If objects are relocated on access, reading the
+           terminator relocates the root. */
+        terminator_object * t = reinterpret_cast<terminator_object*>(static_cast<char*>(m_end) - sizeof(terminator_object));
+        lean_assert(lean_ptr_tag((lean_object*)t) == LeanReserved);
+        m_next = m_end;
+        return t->m_value;
+    }
     while (true) {
         lean_assert(static_cast<char*>(m_next) + sizeof(object) <= m_end);
         object * curr = reinterpret_cast<object*>(m_next);
@@ -5,6 +5,8 @@ Released under Apache 2.0 license as described in the file LICENSE.
 Author: Leonardo de Moura
 */
 #include <cstddef>
+#include <cstring>
+#include <lean/hash.h>
 
 namespace lean {
 
@@ -63,4 +65,75 @@ unsigned hash_str(size_t length, char const * str, unsigned init_value) {
     return c;
 }
 
+// xxHash64 by Yann Collet.
+// https://github.com/Cyan4973/xxHash
+static const uint64 g_xxh_prime1 = 0x9E3779B185EBCA87ull;
+static const uint64 g_xxh_prime2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64 g_xxh_prime3 = 0x165667B19E3779F9ull;
+static const uint64 g_xxh_prime4 = 0x85EBCA77C2B2AE63ull;
+static const uint64 g_xxh_prime5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64 rotl64(uint64 x, unsigned r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64 read64(char const * p) { uint64 v; memcpy(&v, p, sizeof(v)); return v; }
+static inline uint64 read32(char const * p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+
+static inline uint64 xxh_round(uint64 acc, uint64 input) {
+    acc += input * g_xxh_prime2;
+    acc  = rotl64(acc, 31);
+    return acc * g_xxh_prime1;
+}
+
+static inline uint64 xxh_merge_round(uint64 acc, uint64 val) {
+    acc ^= xxh_round(0, val);
+    return acc * g_xxh_prime1 + g_xxh_prime4;
+}
+
+uint64 hash_bytes64(size_t length, char const * str, uint64 seed) {
+    char const * end = str + length;
+    uint64 h;
+    if (length >= 32) {
+        /* four independent lanes, so that the loop is not limited by the latency of the multiplications */
+        uint64 v1 = seed + g_xxh_prime1 + g_xxh_prime2;
+        uint64 v2 = seed + g_xxh_prime2;
+        uint64 v3 = seed;
+        uint64 v4 = seed - g_xxh_prime1;
+        char const * limit = end - 32;
+        do {
+            v1 = xxh_round(v1, read64(str));
+            v2 = xxh_round(v2, read64(str + 8));
+            v3 = xxh_round(v3, read64(str + 16));
+            v4 = xxh_round(v4, read64(str + 24));
+            str += 32;
+        } while (str <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge_round(h, v1);
+        h = xxh_merge_round(h, v2);
+        h = xxh_merge_round(h, v3);
+        h = xxh_merge_round(h, v4);
+    } else {
+        h = seed + g_xxh_prime5;
+    }
+    h += static_cast<uint64>(length);
+    for (; str + 8 <= end; str += 8) {
+        h ^= xxh_round(0, read64(str));
+        h  = rotl64(h, 27) * g_xxh_prime1 + g_xxh_prime4;
+    }
+    if (str + 4 <= end) {
+        h ^= read32(str) * g_xxh_prime1;
+        h  = rotl64(h, 23) * g_xxh_prime2 + g_xxh_prime3;
+        str += 4;
+    }
+    for (; str < end; str++) {
+        h ^= static_cast<unsigned char>(*str) * g_xxh_prime5;
+        h  = rotl64(h, 11) * g_xxh_prime1;
+    }
+    /*-------------------------------------------- avalanche */
+    h ^= h >> 33;
+    h *= g_xxh_prime2;
+    h ^= h >> 29;
+    h *= g_xxh_prime3;
+    h ^= h >> 32;
+    return h;
+}
 }
@@ -9,6 +9,7 @@ Author: Leonardo de Moura
 #include <lean/interrupt.h>
 #include <lean/exception.h>
 #include <lean/memory.h>
+#include <lean/alloc.h>
 
 namespace lean {
 LEAN_THREAD_VALUE(size_t, g_max_heartbeat, 0);
@@ -52,6 +53,7 @@ void check_system(char const * component_name) {
     check_memory(component_name);
     check_interrupted();
     check_heartbeat();
+    display_requested_alloc_stats();
 }
 
 void sleep_for(unsigned ms, unsigned step_ms) {
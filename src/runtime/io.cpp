@@ -20,6 +20,16 @@ Authors: Leonardo de Moura, Sebastian Ullrich
 #endif
 #ifndef LEAN_WINDOWS
 #include <csignal>
+#include <climits>
+#include <sys/uio.h>
+#endif
+#if defined(LEAN_MULTI_THREAD) && defined(__linux__)
+#define LEAN_IO_EVENT_LOOP
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <climits>
+#include <deque>
+#include <unordered_map>
 #endif
 #include <dirent.h>
 #include <fcntl.h>
@@ -39,6 +49,7 @@ Authors: Leonardo de Moura, Sebastian Ullrich
 #include <lean/object.h>
 #include <lean/thread.h>
 #include <lean/allocprof.h>
+#include <lean/stackinfo.h>
 
 #ifdef _MSC_VER
 #define S_ISDIR(mode) ((mode & _S_IFDIR) != 0)
@@ -334,7 +345,7 @@ static object * g_io_error_getline = nullptr;
 
 /*
   Handle.getLine : (@& Handle) → IO Unit
-  The line returned by `lean_io_prim_handle_get_line`
+  On Windows, the line returned by `lean_io_prim_handle_get_line`
   is truncated at the first '\0' character and the
   rest of the line is discarded. */
 extern "C" obj_res lean_io_prim_handle_get_line(b_obj_arg h, obj_arg /* w */) {
@@ -342,29 +353,42 @@ extern "C" obj_res lean_io_prim_handle_get_line(b_obj_arg h, obj_arg /* w */) {
     if (feof(fp)) {
         return io_result_mk_ok(mk_string(""));
     }
-    const int buf_sz = 64;
+#if defined(LEAN_WINDOWS)
+    const int buf_sz = 4096;
     char buf_str[buf_sz]; // NOLINT
     std::string result;
-    bool first = true;
     while (true) {
         char * out = std::fgets(buf_str, buf_sz, fp);
         if (out != nullptr) {
-            if (strlen(buf_str) < buf_sz-1 || buf_str[buf_sz-2] == '\n') {
-                if (first) {
-                    return io_result_mk_ok(mk_string(out));
-                } else {
-                    result.append(out);
-                    return io_result_mk_ok(mk_string(result));
-                }
+            size_t n = strlen(buf_str);
+            result.append(buf_str, n);
+            if (n < buf_sz-1 || buf_str[buf_sz-2] == '\n') {
+                return io_result_mk_ok(mk_string(result));
             }
-            result.append(out);
         } else if (std::feof(fp)) {
             return io_result_mk_ok(mk_string(result));
         } else {
             return io_result_mk_error(g_io_error_getline);
         }
-        first = false;
     }
+#else
+    /* `getline` scans the buffer of `fp` using `memchr`. The line is read into a thread-local buffer that is reused
+       between calls, and copied once into the resulting string. */
+    struct line_buffer {
+        char * m_data{nullptr};
+        size_t m_capacity{0};
+        ~line_buffer() { free(m_data); }
+    };
+    static LEAN_THREAD_LOCAL line_buffer g_line_buffer;
+    ssize_t n = getline(&g_line_buffer.m_data, &g_line_buffer.m_capacity, fp);
+    if (n >= 0) {
+        return io_result_mk_ok(mk_string_from_bytes(g_line_buffer.m_data, n));
+    } else if (std::feof(fp)) {
+        return io_result_mk_ok(mk_string(""));
+    } else {
+        return io_result_mk_error(g_io_error_getline);
+    }
+#endif
 }
 
 /* Handle.putStr : (@& Handle) → (@& String) → IO Unit */
@@ -377,6 +401,393 @@ extern "C" obj_res lean_io_prim_handle_put_str(b_obj_arg h, b_obj_arg s, obj_arg
     }
 }
 
+/* Read the whole file `fname` into a single `String` or `ByteArray` object. The object is allocated with the size
+   reported by `fstat` and filled using `read`, bypassing the `FILE` buffer. Files whose size is not known in advance,
+   e.g. pipes, are supported by growing the object. Strings are read in text mode on Windows. */
+static obj_res io_read_file(b_obj_arg fname, bool as_string) {
+#if defined(LEAN_WINDOWS)
+    int fd = open(string_cstr(fname), O_RDONLY | (as_string ? O_TEXT : O_BINARY));
+#else
+    int fd = open(string_cstr(fname), O_RDONLY | O_CLOEXEC);
+#endif
+    if (fd < 0)
+        return io_result_mk_error(decode_io_error(errno, fname));
+    struct stat st;
+    size_t capacity = fstat(fd, &st) == 0 && st.st_size > 0 ? static_cast<size_t>(st.st_size) : 4096;
+    auto alloc = [&](size_t capacity) {
+        /* strings need an additional byte for the terminating `0` */
+        return as_string ? lean_alloc_string(0, capacity + 1, 0) : lean_alloc_sarray(1, 0, capacity);
+    };
+    auto data = [&](object * o) {
+        return as_string ? const_cast<char *>(lean_string_cstr(o)) : reinterpret_cast<char *>(lean_sarray_cptr(o));
+    };
+    object * r = alloc(capacity);
+    size_t size = 0;
+    while (true) {
+        if (size == capacity) {
+            /* the file is larger than reported, check whether we are at the end before growing the object */
+            char c;
+            int m = read(fd, &c, 1);
+            if (m == 0)
+                break;
+            if (m < 0) {
+                if (errno == EINTR)
+                    continue;
+                int errnum = errno;
+                close(fd);
+                dec_ref(r);
+                return io_result_mk_error(decode_io_error(errnum, fname));
+            }
+            object * new_r = alloc(2 * capacity);
+            memcpy(data(new_r), data(r), size);
+            dec_ref(r);
+            r = new_r;
+            capacity *= 2;
+            data(r)[size++] = c;
+        }
+        auto m = read(fd, data(r) + size, capacity - size);
+        if (m == 0)
+            break;
+        if (m < 0) {
+            if (errno == EINTR)
+                continue;
+            int errnum = errno;
+            close(fd);
+            dec_ref(r);
+            return io_result_mk_error(decode_io_error(errnum, fname));
+        }
+        size += m;
+    }
+    close(fd);
+    if (as_string) {
+        data(r)[size] = 0;
+        lean_to_string(r)->m_size   = size + 1;
+        lean_to_string(r)->m_length = utf8_strlen(data(r), size);
+    } else {
+        lean_sarray_set_size(r, size);
+    }
+    return io_result_mk_ok(r);
+}
+
+/* readFile : (@& FilePath) → IO String */
+extern "C" obj_res lean_io_read_file(b_obj_arg fname, obj_arg /* w */) {
+    return io_read_file(fname, true);
+}
+
+/* readBinFile : (@& FilePath) → IO ByteArray */
+extern "C" obj_res lean_io_read_bin_file(b_obj_arg fname, obj_arg /* w */) {
+    return io_read_file(fname, false);
+}
+
+/* Asynchronous reads and writes.
+
+   On Linux, pending operations on pipes are multiplexed by a single event loop thread using `epoll`, and finish a
+   promise task (see `mk_promise`) when they are done. These operations bypass the `FILE` buffer of the handle, so
+   buffered output is flushed first, and buffered input is returned synchronously, see `get_buffered_input_size`.
+   Operations on other files, and all operations on other platforms or without a task manager, are executed
+   synchronously using the buffered primitives above. In particular, sockets and terminals may be in blocking mode,
+   in which case a write reported as ready by `epoll` can still block the event loop. We do not set `O_NONBLOCK` on
+   them since it is shared with all other users of the open file, e.g. the parent process in the case of a terminal. */
+
+static obj_res io_result_to_except(obj_arg r) {
+    object_ref ref(r);
+    if (io_result_is_ok(r)) {
+        return mk_except_ok(object_ref(io_result_get_value(r), true));
+    } else {
+        return mk_except_error(object_ref(io_result_get_error(r), true));
+    }
+}
+
+#if defined(LEAN_IO_EVENT_LOOP)
+struct io_async_op {
+    int      m_fd;
+    bool     m_write;
+    /* handle of `m_fd`, keeps the file open while the operation is pending */
+    object * m_handle;
+    object * m_promise;
+    /* `ByteArray` to be written */
+    object * m_buf;
+    /* maximum number of bytes to be read */
+    size_t   m_nbytes;
+    /* number of bytes written so far */
+    size_t   m_pos;
+};
+
+/* Try to make progress on `op` after `m_fd` was reported ready. Return the `Except IO.Error _` value of `op` when it is
+   done and `nullptr` otherwise. */
+static object * io_async_op_step(io_async_op & op) {
+    if (!op.m_write) {
+        object * buf = lean_alloc_sarray(1, 0, op.m_nbytes);
+        ssize_t n = ::read(op.m_fd, lean_sarray_cptr(buf), op.m_nbytes);
+        if (n >= 0) {
+            lean_sarray_set_size(buf, n);
+            return mk_except_ok(object_ref(buf));
+        }
+        dec_ref(buf);
+    } else {
+        size_t size = lean_sarray_size(op.m_buf);
+        /* A pipe reported as writable accepts at least `PIPE_BUF` bytes without blocking. */
+        size_t n = std::min(size - op.m_pos, static_cast<size_t>(PIPE_BUF));
+        ssize_t m = ::write(op.m_fd, lean_sarray_cptr(op.m_buf) + op.m_pos, n);
+        if (m >= 0) {
+            op.m_pos += m;
+            if (op.m_pos < size)
+                return nullptr;
+            return mk_except_ok(object_ref(box(0)));
+        }
+    }
+    if (errno == EAGAIN || errno == EINTR)
+        return nullptr;
+    return mk_except_error(object_ref(decode_io_error(errno, nullptr)));
+}
+
+class io_event_loop {
+    struct fd_ops {
+        std::deque<io_async_op> m_reads;
+        std::deque<io_async_op> m_writes;
+    };
+    mutex                           m_mutex;
+    condition_variable              m_finished_cv;
+    int                             m_epoll_fd;
+    /* `eventfd` used for waking up the event loop on shutdown */
+    int                             m_wakeup_fd;
+    std::unordered_map<int, fd_ops> m_fds;
+    bool                            m_running{false};
+    bool                            m_shutting_down{false};
+
+    static uint32_t events_of(fd_ops const & ops) {
+        uint32_t events = 0;
+        if (!ops.m_reads.empty())
+            events |= EPOLLIN;
+        if (!ops.m_writes.empty())
+            events |= EPOLLOUT;
+        return events;
+    }
+
+    void spawn() {
+        m_running = true;
+        lthread([this]() {
+            save_stack_info(false);
+            run();
+            unique_lock<mutex> lock(m_mutex);
+            m_running = false;
+            m_finished_cv.notify_all();
+        });
+        // `lthread` will be implicitly freed, which frees up its control resources but does not terminate the thread
+    }
+
+    void run() {
+        epoll_event events[64];
+        std::vector<io_async_op> done;
+        std::vector<object *> results;
+        while (true) {
+            int n = epoll_wait(m_epoll_fd, events, 64, -1);
+            if (n < 0 && errno != EINTR)
+                return;
+            {
+                unique_lock<mutex> lock(m_mutex);
+                if (m_shutting_down)
+                    return;
+                for (int i = 0; i < n; i++) {
+                    int fd = events[i].data.fd;
+                    auto it = m_fds.find(fd);
+                    if (fd == m_wakeup_fd || it == m_fds.end())
+                        continue;
+                    fd_ops & ops = it->second;
+                    uint32_t ev  = events[i].events;
+                    if ((ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !ops.m_reads.empty()) {
+                        if (object * r = io_async_op_step(ops.m_reads.front())) {
+                            done.push_back(ops.m_reads.front());
+                            results.push_back(r);
+                            ops.m_reads.pop_front();
+                        }
+                    }
+                    if ((ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && !ops.m_writes.empty()) {
+                        if (object * r = io_async_op_step(ops.m_writes.front())) {
+                            done.push_back(ops.m_writes.front());
+                            results.push_back(r);
+                            ops.m_writes.pop_front();
+                        }
+                    }
+                    if (uint32_t mask = events_of(ops)) {
+                        epoll_event e;
+                        e.events  = mask;
+                        e.data.fd = fd;
+                        epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &e);
+                    } else {
+                        epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+                        m_fds.erase(it);
+                    }
+                }
+            }
+            /* The handles may only be released after their file descriptor has been unregistered. */
+            for (size_t i = 0; i < done.size(); i++) {
+                resolve_promise(done[i].m_promise, results[i]);
+                dec(done[i].m_promise);
+                dec(done[i].m_handle);
+                if (done[i].m_buf)
+                    dec(done[i].m_buf);
+            }
+            done.clear();
+            results.clear();
+        }
+    }
+
+public:
+    io_event_loop(int epoll_fd, int wakeup_fd):m_epoll_fd(epoll_fd), m_wakeup_fd(wakeup_fd) {
+        epoll_event e;
+        e.events  = EPOLLIN;
+        e.data.fd = m_wakeup_fd;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &e);
+    }
+
+    ~io_event_loop() {
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_shutting_down = true;
+            uint64_t one = 1;
+            if (::write(m_wakeup_fd, &one, sizeof(one)) == sizeof(one))
+                m_finished_cv.wait(lock, [&]() { return !m_running; });
+        }
+        close(m_wakeup_fd);
+        close(m_epoll_fd);
+    }
+
+    /* Register `op`, taking ownership of its objects. Return `false` if `op.m_fd` is not a pipe. */
+    bool submit(io_async_op const & op) {
+        struct stat st;
+        if (fstat(op.m_fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+            return false;
+        unique_lock<mutex> lock(m_mutex);
+        auto it      = m_fds.find(op.m_fd);
+        bool is_new  = it == m_fds.end();
+        fd_ops & ops = is_new ? m_fds[op.m_fd] : it->second;
+        (op.m_write ? ops.m_writes : ops.m_reads).push_back(op);
+        epoll_event e;
+        e.events  = events_of(ops);
+        e.data.fd = op.m_fd;
+        if (epoll_ctl(m_epoll_fd, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, op.m_fd, &e) != 0) {
+            (op.m_write ? ops.m_writes : ops.m_reads).pop_back();
+            if (is_new)
+                m_fds.erase(op.m_fd);
+            return false;
+        }
+        if (!m_running)
+            spawn();
+        return true;
+    }
+};
+
+static io_event_loop * g_io_event_loop = nullptr;
+
+/* Return the number of bytes of input buffered by `fp`, e.g. by a previous `getLine`, which must be returned before
+   reading from the file descriptor, or -1 if this cannot be determined. */
+static ssize_t get_buffered_input_size(FILE * fp) {
+#if defined(__GLIBC__)
+    // see `freadahead` of gnulib; `_IO_IN_BACKUP` is only defined by the internal headers of glibc
+    const int in_backup = 0x100;
+    if (fp->_IO_write_ptr > fp->_IO_write_base)
+        return 0;
+    return (fp->_IO_read_end - fp->_IO_read_ptr) + ((fp->_flags & in_backup) ? fp->_IO_save_end - fp->_IO_save_base : 0);
+#else
+    (void)fp;
+    return -1;
+#endif
+}
+#endif
+
+/* Handle.readAsync : (@& Handle) → USize → IO (Task (Except IO.Error ByteArray)) */
+extern "C" obj_res lean_io_prim_handle_read_async(b_obj_arg h, usize nbytes, obj_arg /* w */) {
+#if defined(LEAN_IO_EVENT_LOOP)
+    if (ssize_t buffered = get_buffered_input_size(io_get_handle(h))) {
+        /* return the buffered input first, without blocking if we know how much there is */
+        if (buffered > 0)
+            nbytes = std::min(nbytes, static_cast<usize>(buffered));
+        return io_result_mk_ok(task_pure(io_result_to_except(lean_io_prim_handle_read(h, nbytes, io_mk_world()))));
+    }
+    if (object * p = g_io_event_loop ? mk_promise() : nullptr) {
+        io_async_op op { fileno(io_get_handle(h)), false, h, p, nullptr, nbytes, 0 };
+        inc(h); inc(p);
+        if (!g_io_event_loop->submit(op)) {
+            dec(h); dec(p);
+            resolve_promise(p, io_result_to_except(lean_io_prim_handle_read(h, nbytes, io_mk_world())));
+        }
+        return io_result_mk_ok(p);
+    }
+#endif
+    return io_result_mk_ok(task_pure(io_result_to_except(lean_io_prim_handle_read(h, nbytes, io_mk_world()))));
+}
+
+/* Handle.writeAsync : (@& Handle) → (@& ByteArray) → IO (Task (Except IO.Error Unit)) */
+extern "C" obj_res lean_io_prim_handle_write_async(b_obj_arg h, b_obj_arg buf, obj_arg /* w */) {
+#if defined(LEAN_IO_EVENT_LOOP)
+    if (object * p = g_io_event_loop ? mk_promise() : nullptr) {
+        /* data written before using the buffered primitives must come first */
+        if (std::fflush(io_get_handle(h)) != 0) {
+            resolve_promise(p, mk_except_error(object_ref(decode_io_error(errno, nullptr))));
+            return io_result_mk_ok(p);
+        }
+        io_async_op op { fileno(io_get_handle(h)), true, h, p, buf, 0, 0 };
+        inc(h); inc(p); inc(buf);
+        if (!g_io_event_loop->submit(op)) {
+            dec(h); dec(p); dec(buf);
+            resolve_promise(p, io_result_to_except(lean_io_prim_handle_write(h, buf, io_mk_world())));
+        }
+        return io_result_mk_ok(p);
+    }
+#endif
+    return io_result_mk_ok(task_pure(io_result_to_except(lean_io_prim_handle_write(h, buf, io_mk_world()))));
+}
+
+/* Handle.putStrs : (@& Handle) → (@& Array String) → IO Unit */
+extern "C" obj_res lean_io_prim_handle_put_strs(b_obj_arg h, b_obj_arg ss, obj_arg /* w */) {
+    FILE * fp = io_get_handle(h);
+    size_t n  = lean_array_size(ss);
+#if defined(LEAN_WINDOWS)
+    for (size_t i = 0; i < n; i++) {
+        b_obj_arg s = lean_array_get_core(ss, i);
+        size_t sz   = lean_string_size(s) - 1;
+        if (std::fwrite(lean_string_cstr(s), 1, sz, fp) != sz)
+            return io_result_mk_error(decode_io_error(errno, nullptr));
+    }
+    return io_result_mk_ok(box(0));
+#else
+    /* data written before using the buffered primitives must come first */
+    if (std::fflush(fp) != 0)
+        return io_result_mk_error(decode_io_error(errno, nullptr));
+    std::vector<iovec> iov;
+    iov.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        b_obj_arg s = lean_array_get_core(ss, i);
+        size_t sz   = lean_string_size(s) - 1;
+        if (sz > 0)
+            iov.push_back(iovec{const_cast<char *>(lean_string_cstr(s)), sz});
+    }
+    size_t i = 0;
+    while (i < iov.size()) {
+        ssize_t m = writev(fileno(fp), iov.data() + i, static_cast<int>(std::min(iov.size() - i, static_cast<size_t>(IOV_MAX))));
+        if (m < 0) {
+            if (errno == EINTR)
+                continue;
+            return io_result_mk_error(decode_io_error(errno, nullptr));
+        }
+        /* skip what was written, a partial write may end in the middle of a string */
+        size_t k = m;
+        while (k > 0) {
+            if (k >= iov[i].iov_len) {
+                k -= iov[i].iov_len;
+                i++;
+            } else {
+                iov[i].iov_base = static_cast<char *>(iov[i].iov_base) + k;
+                iov[i].iov_len -= k;
+                k = 0;
+            }
+        }
+    }
+    return io_result_mk_ok(box(0));
+#endif
+}
+
 /* monoMsNow : IO Nat */
 extern "C" obj_res lean_io_mono_ms_now(obj_arg /* w */) {
     auto now = std::chrono::steady_clock::now();
@@ -412,6 +823,67 @@ extern "C" obj_res lean_io_get_num_heartbeats(obj_arg /* w */) {
     return io_result_mk_ok(lean_uint64_to_nat(get_num_heartbeats()));
 }
 
+/* getNumCores : IO Nat */
+extern "C" obj_res lean_io_get_num_cores(obj_arg /* w */) {
+    return io_result_mk_ok(mk_nat_obj(hardware_concurrency()));
+}
+
+/* trimHeap : IO Unit */
+extern "C" obj_res lean_io_trim_heap(obj_arg /* w */) {
+    trim_heap();
+    return io_result_mk_ok(box(0));
+}
+
+/* setBackgroundFreeThreshold (n : USize) : IO Unit */
+extern "C" obj_res lean_io_set_background_free_threshold(size_t n, obj_arg /* w */) {
+    lean_set_background_free_threshold(n);
+    return io_result_mk_ok(box(0));
+}
+
+static obj_res uint64s_to_array(std::vector<uint64_t> const & ns) {
+    object * arr = array_mk_empty();
+    for (uint64_t n : ns)
+        arr = lean_array_push(arr, lean_uint64_to_nat(n));
+    return arr;
+}
+
+/*
+structure AllocStats where
+  numSmallAllocs      : Array Nat
+  numSmallDeallocs    : Array Nat
+  numBigAllocs        : Nat
+  numBigDeallocs      : Nat
+  bigAllocBytes       : Nat
+  bigDeallocBytes     : Nat
+  numPages            : Nat
+  numSegments         : Nat
+  numRecycledPages    : Nat
+  numDecommittedPages : Nat
+  numReleasedSegments : Nat
+  numExportedObjs     : Nat
+  numImportedObjs     : Nat
+
+getAllocStats : IO AllocStats
+*/
+extern "C" obj_res lean_io_get_alloc_stats(obj_arg /* w */) {
+    alloc_stats s = get_alloc_stats();
+    object * r = alloc_cnstr(0, 13, 0);
+    cnstr_set(r, 0,  uint64s_to_array(s.m_num_small_alloc));
+    cnstr_set(r, 1,  uint64s_to_array(s.m_num_small_dealloc));
+    cnstr_set(r, 2,  lean_uint64_to_nat(s.m_num_big_alloc));
+    cnstr_set(r, 3,  lean_uint64_to_nat(s.m_num_big_dealloc));
+    cnstr_set(r, 4,  lean_uint64_to_nat(s.m_big_alloc_bytes));
+    cnstr_set(r, 5,  lean_uint64_to_nat(s.m_big_dealloc_bytes));
+    cnstr_set(r, 6,  lean_uint64_to_nat(s.m_num_pages));
+    cnstr_set(r, 7,  lean_uint64_to_nat(s.m_num_segments));
+    cnstr_set(r, 8,  lean_uint64_to_nat(s.m_num_recycled_pages));
+    cnstr_set(r, 9,  lean_uint64_to_nat(s.m_num_decommitted_pages));
+    cnstr_set(r, 10, lean_uint64_to_nat(s.m_num_released_segments));
+    cnstr_set(r, 11, lean_uint64_to_nat(s.m_num_exported_objs));
+    cnstr_set(r, 12, lean_uint64_to_nat(s.m_num_imported_objs));
+    return io_result_mk_ok(r);
+}
+
 extern "C" obj_res lean_io_getenv(b_obj_arg env_var, obj_arg) {
 #if defined(LEAN_EMSCRIPTEN)
     // HACK(WN): getenv doesn't seem to work in Emscripten even though it should
@@ -862,8 +1334,22 @@ void initialize_io() {
     // We want to handle SIGPIPE ourselves
     lean_always_assert(signal(SIGPIPE, SIG_IGN) != SIG_ERR);
 #endif
+#if defined(LEAN_IO_EVENT_LOOP)
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd >= 0) {
+        int wakeup_fd = eventfd(0, EFD_CLOEXEC);
+        if (wakeup_fd >= 0)
+            g_io_event_loop = new io_event_loop(epoll_fd, wakeup_fd);
+        else
+            close(epoll_fd);
+    }
+#endif
 }
 
 void finalize_io() {
+#if defined(LEAN_IO_EVENT_LOOP)
+    delete g_io_event_loop;
+    g_io_event_loop = nullptr;
+#endif
 }
 }
@@ -9,6 +9,10 @@ Author: Leonardo de Moura
 #include <vector>
 #include <deque>
 #include <cmath>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <unordered_map>
 #include <lean/object.h>
 #include <lean/mpq.h>
 #include <lean/thread.h>
@@ -22,6 +26,8 @@ Author: Leonardo de Moura
 
 // see `Task.Priority.max`
 #define LEAN_MAX_PRIO 8
+// idle dedicated workers exit after this many milliseconds
+#define LEAN_DEDICATED_WORKER_IDLE_TIMEOUT 10000
 
 namespace lean {
 extern "C" void lean_internal_panic(char const * msg) {
@@ -227,11 +233,101 @@ static void lean_del_core(object * o, object * & todo) {
     }
 }
 
+#if defined(LEAN_MULTI_THREAD)
+/* Maximal number of objects `lean_del` frees synchronously in a dead graph of multi-threaded objects before handing
+   the rest of the graph to the background reclaimer. The reclaimer is disabled if it is `0`. */
+static atomic<size_t> g_background_free_threshold(0);
+
+/* Thread freeing the dead object graphs handed over by `lean_del`. Recall that all objects reachable from a
+   multi-threaded object are multi-threaded as well, and thus any thread may decrement their reference counters. */
+class reclaimer {
+    mutex                 m_mutex;
+    condition_variable    m_queue_cv;
+    condition_variable    m_finished_cv;
+    /* `todo` lists of `lean_del` */
+    std::vector<object *> m_queue;
+    bool                  m_running{false};
+    bool                  m_shutting_down{false};
+
+    void spawn() {
+        m_running = true;
+        lthread([this]() {
+            save_stack_info(false);
+            unique_lock<mutex> lock(m_mutex);
+            while (true) {
+                if (m_queue.empty()) {
+                    if (m_shutting_down)
+                        break;
+                    m_queue_cv.wait(lock);
+                    continue;
+                }
+                object * todo = m_queue.back();
+                m_queue.pop_back();
+                lock.unlock();
+                while (todo) {
+                    object * o = pop_back(todo);
+                    lean_del_core(o, todo);
+                }
+                lock.lock();
+            }
+            m_running = false;
+            m_finished_cv.notify_all();
+        });
+        // `lthread` will be implicitly freed, which frees up its control resources but does not terminate the thread
+    }
+
+public:
+    void push(object * todo) {
+        unique_lock<mutex> lock(m_mutex);
+        m_queue.push_back(todo);
+        if (m_running)
+            m_queue_cv.notify_one();
+        else
+            spawn();
+    }
+
+    ~reclaimer() {
+        unique_lock<mutex> lock(m_mutex);
+        m_shutting_down = true;
+        m_queue_cv.notify_all();
+        m_finished_cv.wait(lock, [&]() { return !m_running; });
+    }
+};
+
+static reclaimer * g_reclaimer = nullptr;
+#endif
+
+extern "C" void lean_set_background_free_threshold(size_t n) {
+#if defined(LEAN_MULTI_THREAD)
+    g_background_free_threshold.store(n, memory_order_relaxed);
+#else
+    (void)n;
+#endif
+}
+
 extern "C" void lean_del(object * o) {
 #ifdef LEAN_LAZY_RC
     push_back(g_to_free, o);
 #else
     object * todo = nullptr;
+#if defined(LEAN_MULTI_THREAD)
+    size_t threshold = g_background_free_threshold.load(memory_order_relaxed);
+    if (threshold > 0 && lean_is_mt(o)) {
+        for (size_t n = 1;; n++) {
+            lean_del_core(o, todo);
+            if (todo == nullptr)
+                return;
+            if (n == threshold) {
+                // the reclaimer is gone after `finalize_object`, in which case we free the rest ourselves
+                if (reclaimer * r = g_reclaimer) {
+                    r->push(todo);
+                    return;
+                }
+            }
+            o = pop_back(todo);
+        }
+    }
+#endif
     while (true) {
         lean_del_core(o, todo);
         if (todo == nullptr)
@@ -597,6 +693,7 @@ static lean_task_imp * alloc_task_imp(obj_arg c, unsigned prio, bool keep_alive)
     imp->m_closure     = c;
     imp->m_head_dep    = nullptr;
     imp->m_next_dep    = nullptr;
+    imp->m_head_waiter = nullptr;
     imp->m_prio        = prio;
     imp->m_canceled    = false;
     imp->m_keep_alive  = keep_alive;
@@ -608,43 +705,280 @@ static void free_task_imp(lean_task_imp * imp) {
     lean_free_small_object((lean_object*)imp);
 }
 
+struct scoped_current_task_object : flet<lean_task_object *> {
+    scoped_current_task_object(lean_task_object * t):flet(g_current_task_object, t) {}
+};
+
+/* Tasks of priority at most `LEAN_MAX_PRIO` that are ready to be executed, one queue per priority. */
+struct task_queue {
+    mutex                                         m_mutex;
+    std::deque<lean_task_object *>                m_tasks[LEAN_MAX_PRIO+1];
+    /* Number of tasks in `m_tasks`, for skipping empty queues without taking `m_mutex`. */
+    atomic<unsigned>                              m_size{0};
+};
+
+/* State of a standard worker thread. Tasks enqueued by the worker itself are pushed to its own queue, from which it
+   takes the most recent one, while idle workers steal the oldest ones. */
+struct task_worker {
+    unsigned                                      m_idx;
+    task_queue                                    m_queue;
+    /* The following fields are protected by `task_manager::m_sched_mutex`. */
+    condition_variable                            m_wakeup_cv;
+    bool                                          m_wakeup{false};
+    task_worker(unsigned idx):m_idx(idx) {}
+};
+
+LEAN_THREAD_PTR(task_worker, g_task_worker);
+
+/* A thread blocked in `task_manager::wait_for` or `task_manager::wait_any`. It is only woken up by the completion of
+   one of the tasks it registered for. */
+struct task_wait_handle {
+    condition_variable                            m_cv;
+    /* The first of the tasks that finished, protected by `task_manager::m_mutex`. */
+    lean_task_object *                            m_finished{nullptr};
+};
+
+}
+
+/* Registration of a `task_wait_handle` in the waiter list of a task, declared in `lean.h`. */
+struct lean_task_waiter {
+    lean_task_waiter *                            m_next{nullptr};
+    lean::task_wait_handle *                      m_handle{nullptr};
+};
+
+namespace lean {
+
+/* Records the activity of the task manager in the Chrome trace event format, which can be inspected using
+   `chrome://tracing` or Perfetto. It is enabled by setting `LEAN_TASK_TRACE` to the name of the output file, which is
+   written when the task manager is finalized or the process exits. Recording is serialized by `m_mutex`, so tracing
+   is only meant for diagnosing parallelism problems, not for production runs. */
+class task_tracer {
+    typedef std::chrono::steady_clock clock;
+    enum class kind { task, wait, counter, queue_depth };
+    struct event {
+        kind         m_kind;
+        char const * m_name;
+        unsigned     m_tid;
+        double       m_ts;
+        /* duration for `task` and `wait`, value for `counter` */
+        double       m_dur;
+        unsigned     m_prio;
+        /* time spent in the queue for `task` */
+        double       m_queued;
+        /* number of enqueued tasks per priority for `queue_depth` */
+        unsigned     m_queued_per_prio[LEAN_MAX_PRIO+1];
+    };
+    std::string                                         m_file_name;
+    clock::time_point                                   m_start;
+    mutex                                               m_mutex;
+    std::vector<event>                                  m_events;
+    std::unordered_map<lean_task_object *, double>      m_enqueue_time;
+    unsigned                                            m_num_threads{0};
+
+    unsigned thread_id() {
+        LEAN_THREAD_VALUE(unsigned, g_tid, 0);
+        if (g_tid == 0)
+            g_tid = ++m_num_threads;
+        return g_tid;
+    }
+
+    event mk_event(kind k, char const * name, double ts, double dur) {
+        event e;
+        e.m_kind   = k;
+        e.m_name   = name;
+        e.m_tid    = thread_id();
+        e.m_ts     = ts;
+        e.m_dur    = dur;
+        e.m_prio   = 0;
+        e.m_queued = 0;
+        return e;
+    }
+
+public:
+    task_tracer(char const * file_name):m_file_name(file_name), m_start(clock::now()) {}
+
+    /* Microseconds since the creation of the tracer. */
+    double now() const {
+        return std::chrono::duration<double, std::micro>(clock::now() - m_start).count();
+    }
+
+    void enqueued(lean_task_object * t) {
+        double ts = now();
+        lock_guard<mutex> lock(m_mutex);
+        m_enqueue_time[t] = ts;
+    }
+
+    void ran(lean_task_object * t, unsigned prio, double start, double end) {
+        lock_guard<mutex> lock(m_mutex);
+        event e   = mk_event(kind::task, "task", start, end - start);
+        e.m_prio  = prio;
+        auto it   = m_enqueue_time.find(t);
+        if (it != m_enqueue_time.end()) {
+            e.m_queued = start - it->second;
+            m_enqueue_time.erase(it);
+        }
+        m_events.push_back(e);
+    }
+
+    /* Tasks that are deleted before running are not passed to `ran`, so forget their enqueue time before the address
+       is reused. */
+    void freed(lean_task_object * t) {
+        lock_guard<mutex> lock(m_mutex);
+        m_enqueue_time.erase(t);
+    }
+
+    void waited(char const * name, double start, double end) {
+        lock_guard<mutex> lock(m_mutex);
+        m_events.push_back(mk_event(kind::wait, name, start, end - start));
+    }
+
+    void counter(char const * name, double value) {
+        double ts = now();
+        lock_guard<mutex> lock(m_mutex);
+        m_events.push_back(mk_event(kind::counter, name, ts, value));
+    }
+
+    void queue_depth(atomic<unsigned> const * num_queued) {
+        double ts = now();
+        lock_guard<mutex> lock(m_mutex);
+        event e = mk_event(kind::queue_depth, "queued tasks", ts, 0);
+        for (unsigned prio = 0; prio <= LEAN_MAX_PRIO; prio++)
+            e.m_queued_per_prio[prio] = num_queued[prio];
+        m_events.push_back(e);
+    }
+
+    void write() {
+        lock_guard<mutex> lock(m_mutex);
+        std::ofstream out(m_file_name);
+        if (!out) {
+            std::cerr << "failed to write task trace to '" << m_file_name << "'\n";
+            return;
+        }
+        out << std::fixed << std::setprecision(3);
+        out << "{\"traceEvents\": [\n";
+        bool first = true;
+        for (event const & e : m_events) {
+            if (!first) out << ",\n";
+            first = false;
+            out << "{\"name\": \"" << e.m_name << "\", \"pid\": 1, \"tid\": " << e.m_tid << ", \"ts\": " << e.m_ts;
+            switch (e.m_kind) {
+            case kind::task:
+                out << ", \"ph\": \"X\", \"dur\": " << e.m_dur
+                    << ", \"args\": {\"prio\": " << e.m_prio << ", \"queued (us)\": " << e.m_queued << "}}";
+                break;
+            case kind::wait:
+                out << ", \"ph\": \"X\", \"dur\": " << e.m_dur << "}";
+                break;
+            case kind::counter:
+                out << ", \"ph\": \"C\", \"args\": {\"value\": " << e.m_dur << "}}";
+                break;
+            case kind::queue_depth:
+                out << ", \"ph\": \"C\", \"args\": {";
+                for (unsigned prio = 0; prio <= LEAN_MAX_PRIO; prio++) {
+                    if (prio > 0) out << ", ";
+                    out << "\"prio " << prio << "\": " << e.m_queued_per_prio[prio];
+                }
+                out << "}}";
+                break;
+            }
+        }
+        out << "\n]}\n";
+    }
+};
+
+static task_tracer * g_task_tracer = nullptr;
+
 static void free_task(lean_task_object * t) {
+    if (g_task_tracer)
+        g_task_tracer->freed(t);
     if (t->m_imp) free_task_imp(t->m_imp);
     lean_free_small_object((lean_object*)t);
 }
 
-struct scoped_current_task_object : flet<lean_task_object *> {
-    scoped_current_task_object(lean_task_object * t):flet(g_current_task_object, t) {}
-};
-
 class task_manager {
+    /* Protects the state of tasks, i.e., `lean_task_imp` objects and `m_value` fields. */
     mutex                                         m_mutex;
-    unsigned                                      m_num_std_workers{0};
     unsigned                                      m_max_std_workers{0};
-    unsigned                                      m_num_dedicated_workers{0};
-    std::deque<lean_task_object *>                m_queues[LEAN_MAX_PRIO+1];
-    unsigned                                      m_queues_size{0};
-    unsigned                                      m_max_prio{0};
-    condition_variable                            m_queue_cv;
-    condition_variable                            m_task_finished_cv;
+    /* Dedicated workers are kept alive for `LEAN_DEDICATED_WORKER_IDLE_TIMEOUT` after running a task so that bursts of
+       tasks of priority greater than `LEAN_MAX_PRIO` do not create a thread each. The pool is not bounded as such tasks
+       may block indefinitely. Only modified with `m_sched_mutex` held. */
+    atomic<unsigned>                              m_num_dedicated_workers{0};
+    unsigned                                      m_num_idle_dedicated_workers{0};
+    std::deque<lean_task_object *>                m_dedicated_queue;
+    condition_variable                            m_dedicated_queue_cv;
+    /* Number of threads created by the task manager, for tracing. */
+    atomic<unsigned>                              m_num_threads_created{0};
+    /* Tasks enqueued by threads that are not standard workers. */
+    task_queue                                    m_injector;
+    std::vector<std::unique_ptr<task_worker>>     m_workers;
+    /* Number of enqueued tasks per priority, over all queues. */
+    atomic<unsigned>                              m_num_queued[LEAN_MAX_PRIO+1];
+    /* Protects `m_idle_workers`, `m_free_workers`, and the creation and termination of workers. May be acquired while
+       holding `m_mutex`, but not the other way around. */
+    mutex                                         m_sched_mutex;
+    atomic<unsigned>                              m_num_std_workers{0};
+    /* Elements of `m_workers` that are not used by a running standard worker. */
+    std::vector<task_worker *>                    m_free_workers;
+    std::vector<task_worker *>                    m_idle_workers;
+    atomic<unsigned>                              m_num_idle_workers{0};
+    /* Signaled when a standard or dedicated worker terminates, see `~task_manager`. */
     condition_variable                            m_worker_finished_cv;
-    bool                                          m_shutting_down{false};
-
-    lean_task_object * dequeue() {
-        lean_assert(m_queues_size != 0);
-        std::deque<lean_task_object *> & q = m_queues[m_max_prio];
-        lean_assert(!q.empty());
-        lean_task_object * result      = q.front();
-        q.pop_front();
-        m_queues_size--;
-        if (q.empty()) {
-            while (m_max_prio > 0) {
-                --m_max_prio;
-                if (!m_queues[m_max_prio].empty())
-                    break;
+    atomic<bool>                                  m_shutting_down{false};
+    /* Canceled tasks removed from the scheduler by `drop_unobserved`, protected by `m_mutex`. */
+    std::vector<lean_task_object *>               m_dropped;
+
+    bool has_queued_tasks() const {
+        for (unsigned prio = 0; prio <= LEAN_MAX_PRIO; prio++)
+            if (m_num_queued[prio] > 0)
+                return true;
+        return false;
+    }
+
+    void push_task(task_queue & q, lean_task_object * t) {
+        unsigned prio = t->m_imp->m_prio;
+        lock_guard<mutex> lock(q.m_mutex);
+        q.m_tasks[prio].push_back(t);
+        q.m_size++;
+        m_num_queued[prio]++;
+    }
+
+    lean_task_object * pop_task(task_queue & q, unsigned prio, bool newest) {
+        if (q.m_size == 0)
+            return nullptr;
+        lock_guard<mutex> lock(q.m_mutex);
+        std::deque<lean_task_object *> & ts = q.m_tasks[prio];
+        if (ts.empty())
+            return nullptr;
+        lean_task_object * t;
+        if (newest) {
+            t = ts.back();
+            ts.pop_back();
+        } else {
+            t = ts.front();
+            ts.pop_front();
+        }
+        q.m_size--;
+        m_num_queued[prio]--;
+        return t;
+    }
+
+    /* Return a task of the highest priority that is currently enqueued, preferring the ones of `w`. */
+    lean_task_object * find_task(task_worker & w) {
+        for (unsigned prio = LEAN_MAX_PRIO + 1; prio-- > 0;) {
+            if (m_num_queued[prio] == 0)
+                continue;
+            if (lean_task_object * t = pop_task(w.m_queue, prio, true))
+                return t;
+            if (lean_task_object * t = pop_task(m_injector, prio, false))
+                return t;
+            // the queues of unused slots are empty
+            unsigned n = m_workers.size();
+            for (unsigned i = 1; i < n; i++) {
+                if (lean_task_object * t = pop_task(m_workers[(w.m_idx + i) % n]->m_queue, prio, false))
+                    return t;
             }
         }
-        return result;
+        return nullptr;
     }
 
     void enqueue_core(lean_task_object * t) {
@@ -654,14 +988,27 @@ class task_manager {
             spawn_dedicated_worker(t);
             return;
         }
-        if (prio > m_max_prio)
-            m_max_prio = prio;
-        m_queues[prio].push_back(t);
-        m_queues_size++;
-        if (m_num_std_workers < m_max_std_workers)
-            spawn_worker();
-        else
-            m_queue_cv.notify_one();
+        task_worker * w = g_task_worker;
+        if (g_task_tracer)
+            g_task_tracer->enqueued(t);
+        push_task(w ? w->m_queue : m_injector, t);
+        if (g_task_tracer)
+            g_task_tracer->queue_depth(m_num_queued);
+        /* Wake up a single idle worker if there is any. Recall that workers register as idle before checking the
+           queues a last time, so they cannot miss `t`. */
+        if (m_num_idle_workers > 0 || m_num_std_workers < m_max_std_workers) {
+            lock_guard<mutex> lock(m_sched_mutex);
+            if (!m_idle_workers.empty()) {
+                task_worker * idle = m_idle_workers.back();
+                m_idle_workers.pop_back();
+                m_num_idle_workers--;
+                idle->m_wakeup = true;
+                idle->m_wakeup_cv.notify_one();
+            } else if (m_num_std_workers < m_max_std_workers && !m_shutting_down) {
+                // during shutdown, the remaining workers are kept alive until all tasks are done, see `~task_manager`
+                spawn_worker();
+            }
+        }
     }
 
     void deactivate_task_core(unique_lock<mutex> & lock, lean_task_object * t) {
@@ -682,37 +1029,172 @@ class task_manager {
         lock.lock();
     }
 
+    static size_t get_rc(lean_task_object * t) {
+        size_t rc = atomic_load_explicit(lean_get_rc_mt_addr((lean_object*)t), memory_order_acquire);
+#if defined(LEAN_COMPRESSED_OBJECT_HEADER) || defined(LEAN_COMPRESSED_OBJECT_HEADER_SMALL_RC)
+        rc &= (static_cast<size_t>(1) << LEAN_RC_NBITS) - 1;
+#endif
+        return rc;
+    }
+
+    /* Return true if the values of the task `t` and of its dependents cannot be observed anymore, i.e., none of them
+       has been started, and each of them is referenced only by itself (see `m_keep_alive`) and by the closures of its
+       dependents. Recall that the closure of each dependent references the task it depends on. Such tasks are still
+       executed for their side effects unless they are canceled, see `drop_unobserved`. Must be called with `m_mutex`
+       held. */
+    bool is_unobserved(lean_task_object * t) {
+        buffer<lean_task_object *> todo;
+        todo.push_back(t);
+        while (!todo.empty()) {
+            lean_task_object * it = todo.back();
+            todo.pop_back();
+            if (!it->m_imp->m_keep_alive || it->m_imp->m_closure == nullptr)
+                return false;
+            size_t num_refs = 1;
+            for (lean_task_object * dep = it->m_imp->m_head_dep; dep; dep = dep->m_imp->m_next_dep) {
+                if (!dep->m_imp->m_deleted) {
+                    todo.push_back(dep);
+                    num_refs++;
+                }
+            }
+            if (get_rc(it) != num_refs)
+                return false;
+        }
+        return true;
+    }
+
+    /* If the canceled task `t` is unobserved (see `is_unobserved`), add it and its dependents to `m_dropped` instead of
+       running them, and return true. `t` must not be in any queue or dependency list. Must be called with `m_mutex`
+       held, the dropped tasks are freed by `free_dropped`. */
+    bool drop_unobserved(lean_task_object * t) {
+        lean_assert(t->m_imp->m_canceled);
+        if (!is_unobserved(t))
+            return false;
+        size_t i = m_dropped.size();
+        m_dropped.push_back(t);
+        for (; i < m_dropped.size(); i++) {
+            lean_task_object * it = m_dropped[i];
+            for (lean_task_object * dep = it->m_imp->m_head_dep; dep; dep = dep->m_imp->m_next_dep)
+                m_dropped.push_back(dep);
+            it->m_imp->m_head_dep = nullptr;
+            it->m_imp->m_canceled = true;
+            it->m_imp->m_deleted  = true;
+        }
+        return true;
+    }
+
+    /* Free the tasks collected by `drop_unobserved`. Must be called with `m_mutex` held, which is released meanwhile. */
+    void free_dropped(unique_lock<mutex> & lock) {
+        if (m_dropped.empty())
+            return;
+        std::vector<lean_task_object *> dropped;
+        dropped.swap(m_dropped);
+        lock.unlock();
+        /* Releasing the closures decrements the reference counters of the tasks they depend on, so we only free the
+           tasks afterwards. Their own references, see `m_keep_alive`, are simply dropped along with them. */
+        for (lean_task_object * t : dropped) {
+            if (object * c = t->m_imp->m_closure) {
+                t->m_imp->m_closure = nullptr;
+                dec_ref(c);
+            }
+        }
+        for (lean_task_object * t : dropped)
+            free_task(t);
+        lock.lock();
+    }
+
+    /* Must be called with `m_sched_mutex` held. */
     void spawn_worker() {
+        lean_assert(!m_free_workers.empty());
+        task_worker * w = m_free_workers.back();
+        m_free_workers.pop_back();
         m_num_std_workers++;
-        lthread([this]() {
+        m_num_threads_created++;
+        if (g_task_tracer)
+            g_task_tracer->counter("threads created", m_num_threads_created);
+        lthread([this, w]() {
             save_stack_info(false);
-            unique_lock<mutex> lock(m_mutex);
+            g_task_worker = w;
             while (true) {
-                if (m_queues_size == 0) {
-                    if (m_shutting_down) {
-                        break;
-                    }
-                    m_queue_cv.wait(lock);
+                if (lean_task_object * t = find_task(*w)) {
+                    unique_lock<mutex> lock(m_mutex);
+                    run_task(lock, t);
+                    lock.unlock();
+                    reset_heartbeat();
+                    display_requested_alloc_stats();
                     continue;
                 }
-
-                lean_task_object * t = dequeue();
-                run_task(lock, t);
-                reset_heartbeat();
+                unique_lock<mutex> lock(m_sched_mutex);
+                m_idle_workers.push_back(w);
+                m_num_idle_workers++;
+                // dedicated workers may still enqueue tasks during shutdown
+                if (has_queued_tasks() || (m_shutting_down && m_num_dedicated_workers == 0)) {
+                    m_idle_workers.pop_back();
+                    m_num_idle_workers--;
+                    if (has_queued_tasks())
+                        continue;
+                    break;
+                }
+                w->m_wakeup = false;
+                w->m_wakeup_cv.wait(lock, [&]() { return w->m_wakeup; });
             }
+            g_task_worker = nullptr;
+            unique_lock<mutex> lock(m_sched_mutex);
+            m_free_workers.push_back(w);
             m_num_std_workers--;
             m_worker_finished_cv.notify_all();
         });
         // `lthread` will be implicitly freed, which frees up its control resources but does not terminate the thread
     }
 
+    /* Must be called with `m_mutex` held. */
     void spawn_dedicated_worker(lean_task_object * t) {
-        m_num_dedicated_workers++;
+        if (g_task_tracer)
+            g_task_tracer->enqueued(t);
+        if (m_num_idle_dedicated_workers > m_dedicated_queue.size()) {
+            m_dedicated_queue.push_back(t);
+            m_dedicated_queue_cv.notify_one();
+            return;
+        }
+        {
+            lock_guard<mutex> sched_lock(m_sched_mutex);
+            m_num_dedicated_workers++;
+        }
+        m_num_threads_created++;
+        if (g_task_tracer) {
+            g_task_tracer->counter("dedicated workers", m_num_dedicated_workers);
+            g_task_tracer->counter("threads created", m_num_threads_created);
+        }
         lthread([this, t]() {
             save_stack_info(false);
             unique_lock<mutex> lock(m_mutex);
-            run_task(lock, t);
+            lean_task_object * next = t;
+            while (next) {
+                run_task(lock, next);
+                next = nullptr;
+                reset_heartbeat();
+                m_num_idle_dedicated_workers++;
+                auto deadline = chrono::steady_clock::now() + chrono::milliseconds(LEAN_DEDICATED_WORKER_IDLE_TIMEOUT);
+                while (m_dedicated_queue.empty() && !m_shutting_down) {
+                    auto now = chrono::steady_clock::now();
+                    if (now >= deadline)
+                        break;
+                    m_dedicated_queue_cv.wait_for(lock, chrono::duration_cast<chrono::milliseconds>(deadline - now) + chrono::milliseconds(1));
+                }
+                m_num_idle_dedicated_workers--;
+                if (!m_dedicated_queue.empty()) {
+                    next = m_dedicated_queue.front();
+                    m_dedicated_queue.pop_front();
+                }
+            }
+            // `~task_manager` waits on `m_sched_mutex`, so we must not touch `m_mutex` after signaling it
+            lock.unlock();
+            unique_lock<mutex> sched_lock(m_sched_mutex);
             m_num_dedicated_workers--;
+            if (g_task_tracer)
+                g_task_tracer->counter("dedicated workers", m_num_dedicated_workers);
+            if (m_shutting_down && m_num_dedicated_workers == 0)
+                wake_idle_workers();
             m_worker_finished_cv.notify_all();
         });
         // see above
@@ -724,14 +1206,22 @@ class task_manager {
             free_task(t);
             return;
         }
+        if (t->m_imp->m_canceled && drop_unobserved(t)) {
+            free_dropped(lock);
+            return;
+        }
         reset_heartbeat();
         object * v = nullptr;
         {
             scoped_current_task_object scope_cur_task(t);
             object * c = t->m_imp->m_closure;
             t->m_imp->m_closure = nullptr;
+            unsigned prio = t->m_imp->m_prio;
             lock.unlock();
+            double start = g_task_tracer ? g_task_tracer->now() : 0;
             v = lean_apply_1(c, box(0));
+            if (g_task_tracer)
+                g_task_tracer->ran(t, prio, start, g_task_tracer->now());
             // If deactivation was delayed by `m_keep_alive`, deactivate after the final execution (`v != nulltpr`)
             if (v != nullptr && t->m_imp->m_keep_alive) {
                 lean_dec_ref((lean_object*)t);
@@ -745,15 +1235,8 @@ class task_manager {
             free_task(t);
             lock.lock();
         } else if (v != nullptr) {
-            lean_assert(t->m_imp->m_closure == nullptr);
-            handle_finished(t);
-            mark_mt(v);
-            t->m_value = v;
-            /* After the task has been finished and we propagated
-               dependecies, we can release `m_imp` and keep just the value */
-            free_task_imp(t->m_imp);
-            t->m_imp   = nullptr;
-            m_task_finished_cv.notify_all();
+            finish_task(t, v);
+            free_dropped(lock);
         } else {
             // `bind` task has not finished yet, re-add as dependency of nested task
             lock.unlock();
@@ -762,6 +1245,19 @@ class task_manager {
         }
     }
 
+    /* Must be called with `m_mutex` held. */
+    void finish_task(lean_task_object * t, object * v) {
+        lean_assert(t->m_imp->m_closure == nullptr);
+        handle_finished(t);
+        mark_mt(v);
+        t->m_value = v;
+        notify_waiters(t);
+        /* After the task has been finished and we propagated
+           dependecies, we can release `m_imp` and keep just the value */
+        free_task_imp(t->m_imp);
+        t->m_imp   = nullptr;
+    }
+
     void handle_finished(lean_task_object * t) {
         lean_task_object * it = t->m_imp->m_head_dep;
         t->m_imp->m_head_dep = nullptr;
@@ -772,13 +1268,42 @@ class task_manager {
             it->m_imp->m_next_dep = nullptr;
             if (it->m_imp->m_deleted) {
                 free_task(it);
-            } else {
+            } else if (!(it->m_imp->m_canceled && drop_unobserved(it))) {
                 enqueue_core(it);
             }
             it = next_it;
         }
     }
 
+    /* Wake up the threads waiting for `t`. Must be called with `m_mutex` held. */
+    void notify_waiters(lean_task_object * t) {
+        lean_task_waiter * it = t->m_imp->m_head_waiter;
+        t->m_imp->m_head_waiter = nullptr;
+        while (it) {
+            lean_task_waiter * next_it = it->m_next;
+            it->m_next = nullptr;
+            task_wait_handle * h = it->m_handle;
+            it->m_handle = nullptr;
+            if (h->m_finished == nullptr) {
+                h->m_finished = t;
+                h->m_cv.notify_one();
+            }
+            it = next_it;
+        }
+    }
+
+    /* Remove `w` from the waiter list of `t` if it is still registered. Must be called with `m_mutex` held. */
+    void remove_waiter(lean_task_object * t, lean_task_waiter * w) {
+        if (w->m_handle == nullptr)
+            return;
+        lean_task_waiter ** it = &t->m_imp->m_head_waiter;
+        while (*it != w)
+            it = &(*it)->m_next;
+        *it = w->m_next;
+        w->m_next   = nullptr;
+        w->m_handle = nullptr;
+    }
+
     object * wait_any_check(object * task_list) {
         object * it = task_list;
         while (!is_scalar(it)) {
@@ -790,22 +1315,62 @@ class task_manager {
         return nullptr;
     }
 
+    /* Wake up all idle standard workers. Must be called with `m_sched_mutex` held. */
+    void wake_idle_workers() {
+        for (task_worker * w : m_idle_workers) {
+            w->m_wakeup = true;
+            w->m_wakeup_cv.notify_one();
+        }
+        m_idle_workers.clear();
+        m_num_idle_workers = 0;
+    }
+
 public:
     task_manager(unsigned max_std_workers):
         m_max_std_workers(max_std_workers) {
+        for (unsigned prio = 0; prio <= LEAN_MAX_PRIO; prio++)
+            m_num_queued[prio] = 0;
+        for (unsigned i = 0; i < max_std_workers; i++)
+            m_workers.emplace_back(new task_worker(i));
+        for (unsigned i = max_std_workers; i-- > 0;)
+            m_free_workers.push_back(m_workers[i].get());
+        if (!g_task_tracer) {
+            if (char const * file_name = std::getenv("LEAN_TASK_TRACE")) {
+                g_task_tracer = new task_tracer(file_name);
+                // executables never finalize the task manager
+                std::atexit([]() { g_task_tracer->write(); });
+            }
+        }
     }
 
+    /* No standard workers are spawned during shutdown. Instead, the remaining ones run until all dedicated workers,
+       which may still enqueue tasks, are done. */
     ~task_manager() {
-        unique_lock<mutex> lock(m_mutex);
-        m_shutting_down = true;
-        m_queue_cv.notify_all();
+        {
+            unique_lock<mutex> lock(m_mutex);
+            unique_lock<mutex> sched_lock(m_sched_mutex);
+            // make sure that tasks enqueued by dedicated workers can still be run
+            if (m_num_std_workers == 0 && m_num_dedicated_workers > 0 && m_max_std_workers > 0)
+                spawn_worker();
+            m_shutting_down = true;
+            // wake up idle dedicated workers
+            m_dedicated_queue_cv.notify_all();
+        }
+        unique_lock<mutex> lock(m_sched_mutex);
+        wake_idle_workers();
         // wait for all workers to finish
         m_worker_finished_cv.wait(lock, [&]() { return m_num_std_workers + m_num_dedicated_workers == 0; });
+        if (g_task_tracer)
+            g_task_tracer->write();
     }
 
     void enqueue(lean_task_object * t) {
-        unique_lock<mutex> lock(m_mutex);
-        enqueue_core(t);
+        if (t->m_imp->m_prio > LEAN_MAX_PRIO) {
+            unique_lock<mutex> lock(m_mutex);
+            enqueue_core(t);
+        } else {
+            enqueue_core(t);
+        }
     }
 
     void add_dep(lean_task_object * t1, lean_task_object * t2) {
@@ -830,18 +1395,49 @@ public:
         unique_lock<mutex> lock(m_mutex);
         if (t->m_value)
             return;
-        m_task_finished_cv.wait(lock, [&]() { return t->m_value != nullptr; });
+        task_wait_handle h;
+        lean_task_waiter w;
+        w.m_handle = &h;
+        w.m_next   = t->m_imp->m_head_waiter;
+        t->m_imp->m_head_waiter = &w;
+        double start = g_task_tracer ? g_task_tracer->now() : 0;
+        h.m_cv.wait(lock, [&]() { return h.m_finished != nullptr; });
+        if (g_task_tracer)
+            g_task_tracer->waited("wait", start, g_task_tracer->now());
     }
 
     object * wait_any(object * task_list) {
         if (object * t = wait_any_check(task_list))
             return t;
         unique_lock<mutex> lock(m_mutex);
-        while (true) {
-            if (object * t = wait_any_check(task_list))
-                return t;
-            m_task_finished_cv.wait(lock);
+        if (object * t = wait_any_check(task_list))
+            return t;
+        /* Register the same handle on every task of the list, it is woken up by the first one that finishes. */
+        task_wait_handle h;
+        size_t n = 0;
+        for (object * it = task_list; !is_scalar(it); it = cnstr_get(it, 1))
+            n++;
+        std::vector<lean_task_waiter> ws(n);
+        object * it = task_list;
+        for (lean_task_waiter & w : ws) {
+            lean_task_object * t = lean_to_task(lean_ctor_get(it, 0));
+            w.m_handle = &h;
+            w.m_next   = t->m_imp->m_head_waiter;
+            t->m_imp->m_head_waiter = &w;
+            it = cnstr_get(it, 1);
         }
+        double start = g_task_tracer ? g_task_tracer->now() : 0;
+        h.m_cv.wait(lock, [&]() { return h.m_finished != nullptr; });
+        if (g_task_tracer)
+            g_task_tracer->waited("wait any", start, g_task_tracer->now());
+        it = task_list;
+        for (lean_task_waiter & w : ws) {
+            lean_task_object * t = lean_to_task(lean_ctor_get(it, 0));
+            if (t->m_imp)
+                remove_waiter(t, &w);
+            it = cnstr_get(it, 1);
+        }
+        return (object *)h.m_finished;
     }
 
     void deactivate_task(lean_task_object * t) {
@@ -858,10 +1454,52 @@ public:
         }
     }
 
+    /* Finish the promise `t` with value `v`, see `resolve_promise`. */
+    void resolve(lean_task_object * t, object * v) {
+        unique_lock<mutex> lock(m_mutex);
+        lean_assert(t->m_imp);
+        if (t->m_imp->m_deleted) {
+            lock.unlock();
+            lean_dec(v);
+            free_task(t);
+        } else {
+            finish_task(t, v);
+            free_dropped(lock);
+        }
+    }
+
+    /* Cancel `t` and, transitively, all tasks waiting for it. Dependents whose values cannot be observed anymore are
+       removed from the dependency lists and freed without ever being run, see `drop_unobserved`. The remaining ones
+       are marked eagerly so that they can bail out as soon as they are started. Note that each task is in at most one
+       dependency list, so the dependency graph is a forest. */
     void cancel(lean_task_object * t) {
         unique_lock<mutex> lock(m_mutex);
-        if (t->m_imp)
-            t->m_imp->m_canceled = true;
+        if (!t->m_imp)
+            return;
+        t->m_imp->m_canceled = true;
+        buffer<lean_task_object *> todo;
+        todo.push_back(t);
+        while (!todo.empty()) {
+            lean_task_object * it = todo.back();
+            todo.pop_back();
+            lean_task_object ** dep = &it->m_imp->m_head_dep;
+            while (*dep) {
+                lean_task_object * d = *dep;
+                if (d->m_imp->m_deleted) {
+                    dep = &d->m_imp->m_next_dep;
+                    continue;
+                }
+                d->m_imp->m_canceled = true;
+                if (drop_unobserved(d)) {
+                    *dep = d->m_imp->m_next_dep;
+                    d->m_imp->m_next_dep = nullptr;
+                } else {
+                    todo.push_back(d);
+                    dep = &d->m_imp->m_next_dep;
+                }
+            }
+        }
+        free_dropped(lock);
     }
 
     bool shutting_down() const {
@@ -951,6 +1589,19 @@ extern "C" obj_res lean_task_spawn_core(obj_arg c, unsigned prio, bool keep_aliv
     }
 }
 
+obj_res mk_promise() {
+    if (!g_task_manager)
+        return nullptr;
+    lean_task_object * o = alloc_task(box(0), 0, false);
+    /* the task is never executed, so it is `Running` until `resolve_promise` is called */
+    o->m_imp->m_closure = nullptr;
+    return (lean_object*)o;
+}
+
+void resolve_promise(b_obj_arg promise, obj_arg v) {
+    g_task_manager->resolve(lean_to_task(promise), v);
+}
+
 extern "C" obj_res lean_task_pure(obj_arg a) {
     return (lean_object*)alloc_task(a);
 }
@@ -1567,6 +2218,17 @@ extern "C" obj_res lean_string_from_utf8_unchecked(b_obj_arg a) {
     return r;
 }
 
+/* String.fromUTF8SubarrayUnchecked : (@& ByteSubarray) → String */
+extern "C" obj_res lean_string_from_utf8_subarray_unchecked(b_obj_arg s) {
+    b_obj_arg a       = lean_ctor_get(s, 0);
+    b_obj_arg o_start = lean_ctor_get(s, 1);
+    b_obj_arg o_stop  = lean_ctor_get(s, 2);
+    size_t sz         = lean_sarray_size(a);
+    size_t stop       = lean_is_scalar(o_stop) ? std::min(lean_unbox(o_stop), sz) : sz;
+    size_t start      = lean_is_scalar(o_start) ? std::min(lean_unbox(o_start), stop) : stop;
+    return mk_string_from_bytes(reinterpret_cast<char *>(lean_sarray_cptr(a)) + start, stop - start);
+}
+
 extern "C" obj_res lean_string_to_utf8(b_obj_arg s) {
     size_t sz = lean_string_size(s) - 1;
     obj_res r = lean_alloc_sarray(1, sz, sz);
@@ -1574,16 +2236,19 @@ extern "C" obj_res lean_string_to_utf8(b_obj_arg s) {
     return r;
 }
 
-object * mk_string(std::string const & s) {
-    size_t sz  = s.size();
-    size_t len = utf8_strlen(s);
+object * mk_string_from_bytes(char const * s, size_t sz) {
+    size_t len = utf8_strlen(s, sz);
     size_t rsz = sz + 1;
     object * r = lean_alloc_string(rsz, rsz, len);
-    memcpy(w_string_cstr(r), s.data(), sz);
+    memcpy(w_string_cstr(r), s, sz);
     w_string_cstr(r)[sz] = 0;
     return r;
 }
 
+object * mk_string(std::string const & s) {
+    return mk_string_from_bytes(s.data(), s.size());
+}
+
 std::string string_to_std(b_obj_arg o) {
     lean_assert(string_size(o) > 0);
     return std::string(w_string_cstr(o), lean_string_size(o) - 1);
@@ -2131,9 +2796,19 @@ void initialize_object() {
     g_ext_classes_mutex = new mutex();
     g_array_empty       = lean_alloc_array(0, 0);
     mark_persistent(g_array_empty);
+#if defined(LEAN_MULTI_THREAD)
+    g_reclaimer         = new reclaimer();
+#endif
 }
 
 void finalize_object() {
+#if defined(LEAN_MULTI_THREAD)
+    // objects may still be freed afterwards, e.g. by finalizers of other modules
+    g_background_free_threshold.store(0, memory_order_relaxed);
+    reclaimer * r = g_reclaimer;
+    g_reclaimer = nullptr;
+    delete r;
+#endif
     for (external_object_class * cls : *g_ext_classes) delete cls;
     delete g_ext_classes;
     delete g_ext_classes_mutex;
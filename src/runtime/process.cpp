@@ -21,7 +21,17 @@ Author: Jared Roesch
 #else
 #include <unistd.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <cstring>
+#include <vector>
 #include <sys/wait.h>
+#if defined(__APPLE__)
+#include <crt_externs.h>
+#endif
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+/* `posix_spawn_file_actions_addchdir_np` */
+#define LEAN_SPAWN_ADDCHDIR
+#endif
 #endif
 
 #include <lean/object.h>
@@ -232,6 +242,21 @@ extern "C" obj_res lean_io_process_child_wait(b_obj_arg, b_obj_arg child, obj_ar
 
 struct pipe { int m_read_fd; int m_write_fd; };
 
+/* Create a pipe whose ends are closed on `exec`. The child's end is installed on one of its stdio descriptors with `dup2`,
+   which clears the flag on the copy only. Without it, the ends of a pipe created for one child leak into any sibling
+   spawned concurrently from another thread, and the parent does not see EOF on the pipe until the sibling exits too. */
+static int pipe_cloexec(int fds[2]) {
+#if defined(__linux__)
+    return ::pipe2(fds, O_CLOEXEC);
+#else
+    if (::pipe(fds) == -1)
+        return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
 static optional<pipe> setup_stdio(stdio cfg) {
     /* Setup stdio based on process configuration. */
     switch (cfg) {
@@ -240,7 +265,7 @@ static optional<pipe> setup_stdio(stdio cfg) {
         return optional<pipe>();
     case stdio::PIPED:
         int fds[2];
-        if (::pipe(fds) == -1) {
+        if (pipe_cloexec(fds) == -1) {
             throw errno;
         } else {
             return optional<pipe>(pipe { fds[0], fds[1] });
@@ -252,14 +277,110 @@ static optional<pipe> setup_stdio(stdio cfg) {
     lean_unreachable();
 }
 
-static obj_res spawn(string_ref const & proc_name, array_ref<string_ref> const & args, stdio stdin_mode, stdio stdout_mode,
-  stdio stderr_mode, option_ref<string_ref> const & cwd, array_ref<pair_ref<string_ref, option_ref<string_ref>>> const & env) {
-    /* Setup stdio based on process configuration. */
-    auto stdin_pipe  = setup_stdio(stdin_mode);
-    auto stdout_pipe = setup_stdio(stdout_mode);
-    auto stderr_pipe = setup_stdio(stderr_mode);
+static void close_pipe(optional<pipe> const & p) {
+    if (p) {
+        close(p->m_read_fd);
+        close(p->m_write_fd);
+    }
+}
 
-    int pid = fork();
+static char ** get_environ() {
+#if defined(__APPLE__)
+    return *_NSGetEnviron();
+#else
+    return environ;
+#endif
+}
+
+/* Return true iff `entry` is of the form `key=...`. */
+static bool env_entry_has_key(char const * entry, string_ref const & key) {
+    size_t n = key.num_bytes();
+    return strncmp(entry, key.data(), n) == 0 && entry[n] == '=';
+}
+
+/* Compute the environment of the child: the parent's environment, with the variables in `env` set or unset.
+   The strings of the result are owned by `storage` and by the parent's environment. */
+static void mk_child_env(array_ref<pair_ref<string_ref, option_ref<string_ref>>> const & env,
+                         std::vector<std::string> & storage, buffer<char *> & envp) {
+    for (char ** it = get_environ(); *it; it++) {
+        bool overridden = false;
+        for (auto & entry : env) {
+            if (env_entry_has_key(*it, entry.fst())) {
+                overridden = true;
+                break;
+            }
+        }
+        if (!overridden)
+            envp.push_back(*it);
+    }
+    storage.reserve(env.size());
+    for (size_t i = 0; i < env.size(); i++) {
+        if (!env[i].snd())
+            continue;
+        /* As with repeated `setenv` calls, the last binding of a variable wins. */
+        bool shadowed = false;
+        for (size_t j = i + 1; j < env.size(); j++) {
+            if (env[j].fst() == env[i].fst()) {
+                shadowed = true;
+                break;
+            }
+        }
+        if (shadowed)
+            continue;
+        storage.push_back(std::string(env[i].fst().data()) + "=" + env[i].snd().get()->data());
+        envp.push_back(const_cast<char *>(storage.back().c_str()));
+    }
+    envp.push_back(nullptr);
+}
+
+static int add_stdio_action(posix_spawn_file_actions_t * actions, optional<pipe> const & p, stdio mode, int fd) {
+    if (p) {
+        /* The other end of the pipe is closed on `exec`. */
+        return posix_spawn_file_actions_adddup2(actions, fd == STDIN_FILENO ? p->m_read_fd : p->m_write_fd, fd);
+    } else if (mode == stdio::NUL) {
+        return posix_spawn_file_actions_addopen(actions, fd, "/dev/null", fd == STDIN_FILENO ? O_RDONLY : O_WRONLY, 0);
+    } else {
+        return 0;
+    }
+}
+
+/* Spawn the child using `posix_spawnp`, with stdio redirection and the working directory expressed as file actions.
+   Unlike `fork`, it does not copy the page tables of the parent (glibc implements it using `clone(CLONE_VM | CLONE_VFORK)`),
+   so its cost does not grow with the size of the parent. This matters when spawning many processes from a large one,
+   e.g. one compiler per module from a build driver. Return an error number on failure. */
+static int spawn_posix(pid_t & pid, buffer<char *> const & pargs, optional<pipe> const & stdin_pipe, stdio stdin_mode,
+                       optional<pipe> const & stdout_pipe, stdio stdout_mode, optional<pipe> const & stderr_pipe, stdio stderr_mode,
+                       option_ref<string_ref> const & cwd, array_ref<pair_ref<string_ref, option_ref<string_ref>>> const & env) {
+    std::vector<std::string> env_storage;
+    buffer<char *> envp;
+    mk_child_env(env, env_storage, envp);
+
+    posix_spawn_file_actions_t actions;
+    int err = posix_spawn_file_actions_init(&actions);
+    if (err != 0)
+        return err;
+    err = add_stdio_action(&actions, stdin_pipe, stdin_mode, STDIN_FILENO);
+    if (err == 0)
+        err = add_stdio_action(&actions, stdout_pipe, stdout_mode, STDOUT_FILENO);
+    if (err == 0)
+        err = add_stdio_action(&actions, stderr_pipe, stderr_mode, STDERR_FILENO);
+#if defined(LEAN_SPAWN_ADDCHDIR)
+    if (err == 0 && cwd)
+        err = posix_spawn_file_actions_addchdir_np(&actions, cwd.get()->data());
+#else
+    lean_assert(!cwd);
+#endif
+    if (err == 0)
+        err = posix_spawnp(&pid, pargs[0], &actions, nullptr, pargs.data(), envp.data());
+    posix_spawn_file_actions_destroy(&actions);
+    return err;
+}
+
+/* Spawn the child using `fork` and `execvp`. Used when `posix_spawnp` cannot express the request. */
+static int spawn_fork(pid_t & pid, buffer<char *> const & pargs, optional<pipe> const & stdin_pipe, stdio stdin_mode,
+                      optional<pipe> const & stdout_pipe, stdio stdout_mode, optional<pipe> const & stderr_pipe, stdio stderr_mode,
+                      option_ref<string_ref> const & cwd, array_ref<pair_ref<string_ref, option_ref<string_ref>>> const & env) {
+    pid = fork();
 
     if (pid == 0) {
         for (auto & entry : env) {
@@ -301,18 +422,50 @@ static obj_res spawn(string_ref const & proc_name, array_ref<string_ref> const &
             }
         }
 
-        buffer<char *> pargs;
-        pargs.push_back(strdup(proc_name.data()));
-        for (auto & arg : args)
-            pargs.push_back(strdup(arg.data()));
-        pargs.push_back(NULL);
-
         if (execvp(pargs[0], pargs.data()) < 0) {
             std::cerr << "could not execute external process '" << pargs[0] << "'" << std::endl;
             exit(-1);
         }
     } else if (pid == -1) {
-        throw errno;
+        return errno;
+    }
+    return 0;
+}
+
+static obj_res spawn(string_ref const & proc_name, array_ref<string_ref> const & args, stdio stdin_mode, stdio stdout_mode,
+  stdio stderr_mode, option_ref<string_ref> const & cwd, array_ref<pair_ref<string_ref, option_ref<string_ref>>> const & env) {
+    /* Setup stdio based on process configuration. */
+    auto stdin_pipe  = setup_stdio(stdin_mode);
+    auto stdout_pipe = setup_stdio(stdout_mode);
+    auto stderr_pipe = setup_stdio(stderr_mode);
+
+    buffer<char *> pargs;
+    pargs.push_back(const_cast<char *>(proc_name.data()));
+    for (auto & arg : args)
+        pargs.push_back(const_cast<char *>(arg.data()));
+    pargs.push_back(NULL);
+
+    /* `posix_spawnp` searches the program in the `PATH` of the parent, while `execvp` after `setenv` in the child
+       searches the one given in `env`. */
+    bool use_fork = false;
+    for (auto & entry : env) {
+        if (entry.fst() == "PATH")
+            use_fork = true;
+    }
+#if !defined(LEAN_SPAWN_ADDCHDIR)
+    if (cwd)
+        use_fork = true;
+#endif
+
+    pid_t pid;
+    int err = use_fork ?
+        spawn_fork(pid, pargs, stdin_pipe, stdin_mode, stdout_pipe, stdout_mode, stderr_pipe, stderr_mode, cwd, env) :
+        spawn_posix(pid, pargs, stdin_pipe, stdin_mode, stdout_pipe, stdout_mode, stderr_pipe, stderr_mode, cwd, env);
+    if (err != 0) {
+        close_pipe(stdin_pipe);
+        close_pipe(stdout_pipe);
+        close_pipe(stderr_pipe);
+        throw err;
     }
 
     object * parent_stdin  = box(0);
@@ -179,9 +179,23 @@ std::string stem(std::string const & fname) {
 std::string read_file(std::string const & fname, std::ios_base::openmode mode) {
     std::ifstream in(fname, mode);
     if (!in.good()) throw file_not_found_exception(fname);
-    std::stringstream buf;
-    buf << in.rdbuf();
-    return buf.str();
+    // read into a string of the final size instead of going through a `stringstream`
+    in.seekg(0, std::ios_base::end);
+    std::streamoff size = in.tellg();
+    if (size < 0) {
+        // not seekable
+        in.clear();
+        in.seekg(0, std::ios_base::beg);
+        std::stringstream buf;
+        buf << in.rdbuf();
+        return buf.str();
+    }
+    in.seekg(0, std::ios_base::beg);
+    std::string r(static_cast<size_t>(size), '\0');
+    in.read(&r[0], size);
+    // fewer characters may have been read in text mode on Windows
+    r.resize(static_cast<size_t>(in.gcount()));
+    return r;
 }
 
 time_t get_mtime(std::string const &fname) {
@@ -0,0 +1,30 @@
+/-
+Stress test for the multi-threaded small object allocator. In each round, a set of producer tasks build lists on
+dedicated threads, and a set of consumer tasks on other dedicated threads traverse and free them. Thus, most
+deallocations are cross-thread frees, and the heaps of the finished threads become orphans that are adopted by the
+threads of later rounds.
+-/
+def produce (seed n : Nat) : List Nat := Id.run do
+  let mut l : List Nat := []
+  for i in [0:n] do
+    l := (seed + i) :: l
+  return l
+
+def consume (l : List Nat) : Nat :=
+  l.foldl (· + ·) 0
+
+def round (r tasks n : Nat) : Nat :=
+  let producers := (List.range tasks).map fun i =>
+    Task.spawn (fun _ => produce (r + i) n) Task.Priority.dedicated
+  let consumers := producers.map fun t =>
+    Task.spawn (fun _ => consume t.get) Task.Priority.dedicated
+  consumers.foldl (fun s t => s + t.get) 0
+
+def main : List String → IO UInt32
+  | [rounds, tasks, n] => do
+    let mut total := 0
+    for r in [0:rounds.toNat!] do
+      total := total + round r tasks.toNat! n.toNat!
+    IO.println s!"total: {total}"
+    pure 0
+  | _ => pure 1
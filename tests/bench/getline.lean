@@ -0,0 +1,29 @@
+/-
+Throughput of line-oriented input: a file of `n` lines of varying length is written once and then read back `reps`
+times using `Handle.getLine`, as done when processing logs or LSP messages.
+-/
+def mkLine (i : Nat) : String :=
+  "line " ++ toString i ++ ": " ++ "".pushn 'x' (i % 97)
+
+partial def readLines (h : IO.FS.Handle) (lines chars : Nat) : IO (Nat × Nat) := do
+  let line ← h.getLine
+  if line.isEmpty then
+    return (lines, chars)
+  else
+    readLines h (lines + 1) (chars + line.length)
+
+def main : List String → IO UInt32
+  | [n, reps] => do
+    let fname : System.FilePath := "getline.lean.txt"
+    IO.FS.withFile fname IO.FS.Mode.write fun h => do
+      for i in [0:n.toNat!] do
+        h.putStrLn (mkLine i)
+    let mut total := (0, 0)
+    for _ in [0:reps.toNat!] do
+      let h ← IO.FS.Handle.mk fname IO.FS.Mode.read
+      let (lines, chars) ← readLines h 0 0
+      total := (total.1 + lines, total.2 + chars)
+    IO.FS.removeFile fname
+    IO.println s!"lines: {total.1}, chars: {total.2}"
+    pure 0
+  | _ => pure 1
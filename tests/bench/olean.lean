@@ -0,0 +1,50 @@
+import Lean.Environment
+import Lean.Util.Path
+open Lean System
+
+/-
+Trade-off between the size of .olean files and the time to import them, see `olean_compression` in `module.cpp`.
+* `olean copy src dst`: copy the .olean files below `src` to `dst`, and print their total size. The copies are
+  compressed if `LEAN_OLEAN_COMPRESS` is set and Lean was built with `-DZLIB=ON`.
+* `olean import dir mod`: import module `mod` from the .olean files below `dir`.
+-/
+
+partial def findOleans (dir : FilePath) : IO (Array FilePath) := do
+  let mut result : Array FilePath := #[]
+  for entry in (← dir.readDir) do
+    if (← entry.path.isDir : Bool) then
+      result := result ++ (← findOleans entry.path)
+    else if entry.path.extension == some "olean" then
+      result := result.push entry.path
+  return result
+
+def copy (src dst : FilePath) : IO Unit := do
+  let files ← findOleans src
+  let mut mods := #[]
+  let mut regions := #[]
+  for file in files do
+    let (mod, region) ← readModuleData file
+    mods := mods.push mod
+    regions := regions.push region
+  linkModuleRegions regions
+  let mut bytes : Nat := 0
+  for i in [0:files.size] do
+    let rel : FilePath := ⟨files[i].toString.drop (src.toString.length + 1)⟩
+    let out := dst / rel
+    if let some parent := out.parent then
+      IO.FS.createDirAll parent
+    let modName := (rel.withExtension "").components.foldl Name.mkStr Name.anonymous
+    saveModuleData out modName #[] mods[i]
+    bytes := bytes + (← out.metadata).byteSize.toNat
+  IO.println s!"bytes .olean: {bytes}"
+
+def main : List String → IO UInt32
+  | ["copy", src, dst] => do
+    copy src dst
+    pure 0
+  | ["import", dir, mod] => do
+    searchPathRef.set [dir]
+    let env ← importModules [{ module := mod.toName }] {}
+    IO.println s!"constants: {env.constants.size}"
+    pure 0
+  | _ => pure 1
@@ -0,0 +1,20 @@
+/-
+Latency of process creation from a parent with a large resident set: `mb` MiB of heap are allocated and touched, and
+then `n` trivial child processes are spawned and waited for one after the other, as done by a build driver running
+one compiler per module.
+-/
+def spawnTrue : IO UInt32 := do
+  let child ← IO.Process.spawn { cmd := "true", stdin := IO.Process.Stdio.null, stdout := IO.Process.Stdio.null }
+  child.wait
+
+def main : List String → IO UInt32
+  | [mb, n] => do
+    -- 8 bytes per element
+    let heap := mkArray (mb.toNat! * 131072) (0 : Nat)
+    let mut failed := 0
+    for _ in [0:n.toNat!] do
+      if (← spawnTrue) != 0 then
+        failed := failed + 1
+    IO.println s!"spawned: {n}, failed: {failed}, heap: {heap.size / 131072} MiB"
+    pure 0
+  | _ => pure 1
@@ -0,0 +1,16 @@
+def bytes : ByteArray := "hello, world\n".toUTF8
+
+def check (b : Bool) (msg : String) : IO Unit :=
+  unless b do throw <| IO.userError msg
+
+#eval id (α := IO _) do
+  let s := bytes.toSubarray 7
+  check (s.size == 6) "size"
+  check (s.get! 0 == 'w'.toNat.toUInt8) "get!"
+  check (String.fromUTF8SubarrayUnchecked s == "world\n") "fromUTF8SubarrayUnchecked"
+  let t := s.slice 1 3
+  check (String.fromUTF8SubarrayUnchecked t == "or") "slice"
+  check (t.toByteArray.size == 2) "toByteArray"
+  check (s.findIdx? (· == '\n'.toNat.toUInt8) == some 5) "findIdx?"
+  check (s.foldl (fun n _ => n + 1) 0 == 6) "foldl"
+  check ((bytes.toSubarray 20 30).isEmpty) "clamping"
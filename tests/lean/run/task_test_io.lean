@@ -33,3 +33,32 @@
   Task.spawn fun _ => dbgSleep 3 fun _ => "B",
   Task.spawn fun _ => dbgSleep 1 fun _ => "C"
 ]
+
+partial def spinUntilCanceled : IO Unit := do
+  unless (← IO.checkCanceled) do
+    IO.sleep 1
+    spinUntilCanceled
+
+-- canceling a task also cancels the tasks waiting for it
+#eval id (α := IO _) do
+  let t0 ← IO.asTask spinUntilCanceled
+  let t1 ← IO.mapTask (fun _ => IO.checkCanceled) t0
+  let t2 ← IO.mapTask (fun _ => IO.checkCanceled) t1
+  IO.cancel t0
+  let c1 ← IO.ofExcept t1.get
+  let c2 ← IO.ofExcept t2.get
+  unless c1 && c2 do
+    throw <| IO.userError "dependents were not canceled"
+
+-- dependents of a canceled task that are no longer referenced are not run at all
+#eval id (α := IO _) do
+  let started ← IO.mkRef 0
+  let t0 ← IO.asTask spinUntilCanceled
+  for _ in [0:100] do
+    discard <| IO.mapTask (fun _ => started.modify (· + 1)) t0
+  IO.cancel t0
+  discard <| IO.wait t0
+  IO.sleep 100
+  let n ← started.get
+  unless n == 0 do
+    throw <| IO.userError s!"{n} canceled dependents were run"